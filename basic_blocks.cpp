@@ -0,0 +1,258 @@
+#include "basic_blocks.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "util.h"
+
+static constexpr uint32_t ebreak = 0x00100073;
+static constexpr uint32_t c_ebreak = 0x9002;
+
+static int64_t sext(uint64_t val, int bits) {
+    return static_cast<int64_t>(val << (64 - bits)) >> (64 - bits);
+}
+
+static int64_t j_offset(uint32_t i) {
+    return sext((((i >> 31) & 1) << 20) | (((i >> 12) & 0xff) << 12) | (((i >> 20) & 1) << 11)
+                | (((i >> 21) & 0x3ff) << 1), 21);
+}
+
+static int64_t b_offset(uint32_t i) {
+    return sext((((i >> 31) & 1) << 12) | (((i >> 7) & 1) << 11) | (((i >> 25) & 0x3f) << 5)
+                | (((i >> 8) & 0xf) << 1), 13);
+}
+
+/* c.j */
+static int64_t cj_offset(uint32_t i) {
+    return sext((((i >> 12) & 1) << 11) | (((i >> 11) & 1) << 4) | (((i >> 9) & 0b11) << 8)
+                | (((i >> 8) & 1) << 10) | (((i >> 7) & 1) << 6) | (((i >> 6) & 1) << 7)
+                | (((i >> 3) & 0b111) << 1) | (((i >> 2) & 1) << 5), 12);
+}
+
+/* c.beqz and c.bnez */
+static int64_t cb_offset(uint32_t i) {
+    return sext((((i >> 12) & 1) << 8) | (((i >> 10) & 0b11) << 3) | (((i >> 5) & 0b11) << 6)
+                | (((i >> 3) & 0b11) << 1) | (((i >> 2) & 1) << 5), 9);
+}
+
+flow_info decode_flow(uint32_t i) {
+    if ((i & 0b11) != 0b11) {
+        uint32_t quadrant = i & 0b11;
+        uint32_t funct3 = (i >> 13) & 0b111;
+
+        if (quadrant == 0b01 && funct3 == 0b101) {
+            return { Flow::Direct, cj_offset(i) };
+        }
+
+        if (quadrant == 0b01 && (funct3 == 0b110 || funct3 == 0b111)) {
+            return { Flow::Conditional, cb_offset(i) };
+        }
+
+        /* c.jr and c.jalr, rs2 = 0 and rs1 != 0 */
+        if (quadrant == 0b10 && funct3 == 0b100 && ((i >> 2) & 0x1f) == 0 && ((i >> 7) & 0x1f) != 0) {
+            return { Flow::Indirect, 0 };
+        }
+
+        return { Flow::None, 0 };
+    }
+
+    switch (i & 0x7f) {
+        case 0x6f: return { Flow::Direct, j_offset(i) };
+        case 0x63: return { Flow::Conditional, b_offset(i) };
+        case 0x67: return { Flow::Indirect, 0 };
+        case 0x17: return { Flow::PcRelative, 0 };
+        default:   return { Flow::None, 0 };
+    }
+}
+
+/* Only fetch the upper half when needed, the code might end after a compressed instruction */
+static uint32_t fetch(uintptr_t pc, uintptr_t end) {
+    uint32_t instr = *reinterpret_cast<const uint16_t*>(pc);
+    if ((instr & 0b11) == 0b11 && pc + 4 <= end) {
+        instr |= static_cast<uint32_t>(reinterpret_cast<const uint16_t*>(pc)[1]) << 16;
+    }
+
+    return instr;
+}
+
+static uint8_t instr_length(uint32_t instr) {
+    return (instr & 0b11) == 0b11 ? 4 : 2;
+}
+
+/* Linear sweep over [from, to), collecting instruction starts and the blocks they begin */
+static void sweep(uintptr_t from, uintptr_t to, std::vector<uintptr_t>& starts, std::vector<uintptr_t>& leaders) {
+    for (uintptr_t pc = from; pc + 2 <= to;) {
+        uint32_t instr = fetch(pc, to);
+        uint8_t length = instr_length(instr);
+        if (pc + length > to) {
+            break;
+        }
+
+        starts.push_back(pc);
+
+        flow_info flow = decode_flow(instr);
+        if (flow.kind == Flow::Direct || flow.kind == Flow::Conditional) {
+            leaders.push_back(pc + flow.offset);
+        }
+
+        /* Fallthrough of a branch, or where a call returns to */
+        if (flow.kind != Flow::None && flow.kind != Flow::PcRelative) {
+            leaders.push_back(pc + length);
+        }
+
+        pc += length;
+    }
+}
+
+/* Where a sweep starts, and the furthest it may go */
+struct sweep_root {
+    uintptr_t pc;
+    uintptr_t end;
+};
+
+std::vector<basic_block> find_basic_blocks(const elf_file& elf, const safe_map& program) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(program.map());
+    uintptr_t end = begin + program.size();
+
+    /* Never sweep into the data that shares the segment, only without section headers go by the segment */
+    std::vector<elf_section> code;
+    for (const elf_section& section : elf.code_sections()) {
+        uintptr_t from = std::max(section.addr, begin);
+        uintptr_t to = std::min(section.addr + section.size, end);
+
+        if (from < to) {
+            code.push_back(elf_section { from, to - from });
+        }
+    }
+
+    if (elf.code_sections().empty()) {
+        code.push_back(elf_section { begin, end - begin });
+    }
+
+    auto section_end = [&code](uintptr_t pc) -> uintptr_t {
+        for (const elf_section& section : code) {
+            if (pc >= section.addr && pc < section.addr + section.size) {
+                return section.addr + section.size;
+            }
+        }
+
+        return 0;
+    };
+
+    /* Every code section is a root too, so a stripped executable still gets swept */
+    std::vector<sweep_root> roots;
+    for (const elf_section& section : code) {
+        roots.push_back(sweep_root { section.addr, section.addr + section.size });
+    }
+
+    for (const elf_symbol& sym : elf.symbols()) {
+        if (uintptr_t limit = section_end(sym.addr)) {
+            roots.push_back(sweep_root { sym.addr, sym.size ? std::min(limit, sym.addr + sym.size) : limit });
+        }
+    }
+
+    if (uintptr_t limit = section_end(elf.entry())) {
+        roots.push_back(sweep_root { elf.entry(), limit });
+    }
+
+    /* Where a function and a label start at the same address, the function's size wins */
+    std::sort(roots.begin(), roots.end(), [](const sweep_root& a, const sweep_root& b) {
+        return a.pc != b.pc ? a.pc < b.pc : a.end < b.end;
+    });
+
+    roots.erase(std::unique(roots.begin(), roots.end(), [](const sweep_root& a, const sweep_root& b) {
+        return a.pc == b.pc;
+    }), roots.end());
+
+    std::vector<uintptr_t> starts;
+    std::vector<uintptr_t> leaders;
+
+    /* Labels inside a function stop where it does, not at the end of the section */
+    uintptr_t function_end = 0;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        sweep_root& root = roots[i];
+        if (root.pc < function_end) {
+            root.end = std::min(root.end, function_end);
+        }
+
+        /* Sized, so a function */
+        if (root.end < section_end(root.pc)) {
+            function_end = root.end;
+        }
+
+        leaders.push_back(root.pc);
+        sweep(root.pc, i + 1 < roots.size() ? std::min(root.end, roots[i + 1].pc) : root.end, starts, leaders);
+    }
+
+    std::sort(starts.begin(), starts.end());
+    std::sort(leaders.begin(), leaders.end());
+    leaders.erase(std::unique(leaders.begin(), leaders.end()), leaders.end());
+
+    /* Targets the sweep didn't see an instruction at are most likely data */
+    std::vector<basic_block> blocks;
+    for (uintptr_t pc : leaders) {
+        if (!std::binary_search(starts.begin(), starts.end(), pc)) {
+            continue;
+        }
+
+        uint32_t instr = fetch(pc, end);
+        uint8_t length = instr_length(instr);
+        if (length == 2) {
+            instr &= 0xffff;
+        }
+
+        if (instr == 0 || instr == TEST_END_MARKER || instr == ebreak || instr == c_ebreak) {
+            continue;
+        }
+
+        blocks.push_back(basic_block { pc, instr, length });
+    }
+
+    return blocks;
+}
+
+void plant_breakpoints(const safe_map& program, std::span<const basic_block> blocks) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(program.map());
+    uintptr_t end = begin + program.size();
+
+    /* All at once, a pair of mprotects per block adds up for large executables */
+    uintptr_t code_begin = begin & ~(page_size - 1);
+    if (mprotect(reinterpret_cast<void*>(code_begin), end - code_begin, PROT_READ | PROT_WRITE) != 0) {
+        throw std::runtime_error(std::string("Making code writable failed: ") + strerror(errno));
+    }
+
+    for (const basic_block& b : blocks) {
+        if (b.length == 2) {
+            uint16_t bp = c_ebreak;
+            memcpy(reinterpret_cast<void*>(b.pc), &bp, sizeof(bp));
+        } else {
+            memcpy(reinterpret_cast<void*>(b.pc), &ebreak, sizeof(ebreak));
+        }
+    }
+
+    mprotect(reinterpret_cast<void*>(code_begin), end - code_begin, program.prot());
+    __builtin___clear_cache(reinterpret_cast<char*>(begin), reinterpret_cast<char*>(end));
+}
+
+void write_instruction(uintptr_t pc, uint32_t instr, uint8_t length, int prot) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t page_begin = pc & ~(page_size - 1);
+    uintptr_t page_end = (pc + length + page_size - 1) & ~(page_size - 1);
+    void* pages = reinterpret_cast<void*>(page_begin);
+
+    if (mprotect(pages, page_end - page_begin, PROT_READ | PROT_WRITE) != 0) {
+        crash_and_burn("failed to make code writable");
+    }
+
+    memcpy(reinterpret_cast<void*>(pc), &instr, length);
+
+    mprotect(pages, page_end - page_begin, prot);
+    __builtin___clear_cache(reinterpret_cast<char*>(pc), reinterpret_cast<char*>(pc + length));
+}
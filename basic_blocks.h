@@ -0,0 +1,54 @@
+#ifndef BASIC_BLOCKS_H
+#define BASIC_BLOCKS_H
+
+#include <span>
+#include <vector>
+
+#include <cstdint>
+
+#include "elf_file.h"
+
+/* How an instruction affects control flow, and whether it depends on its own address */
+enum class Flow : uint8_t {
+    None,
+    Direct,
+    Conditional,
+    Indirect,
+    PcRelative,
+};
+
+struct flow_info {
+    Flow kind;
+
+    /* From the instruction to the target, for Direct and Conditional */
+    int64_t offset;
+};
+
+/* Only the lower 16 bits are looked at for compressed instructions */
+flow_info decode_flow(uint32_t instr);
+
+/* First instruction of a basic block, as it was in the code */
+struct basic_block {
+    uintptr_t pc;
+    uint32_t original;
+    uint8_t length;
+};
+
+/**
+ * Blocks in one of elf's executable segments, sorted by pc. Found by a linear sweep
+ * starting at every code section, symbol and the entry point. A sweep never leaves its
+ * section (the segment also holds the ELF header, .rodata and .eh_frame), and stops at
+ * the end of a function symbol's st_size or the next root. Only an executable without
+ * section headers is swept by segment. Blocks start at those roots, at direct jump and
+ * branch targets and after any jump or branch. Blocks starting with a zero, the test
+ * end marker or a breakpoint are left out.
+ */
+std::vector<basic_block> find_basic_blocks(const elf_file& elf, const safe_map& program);
+
+/* Replace the first instruction of every block by an ebreak (c.ebreak if compressed), throws */
+void plant_breakpoints(const safe_map& program, std::span<const basic_block> blocks);
+
+/* Put a single instruction into code mapped with prot, signal-safe */
+void write_instruction(uintptr_t pc, uint32_t instr, uint8_t length, int prot);
+
+#endif /* BASIC_BLOCKS_H */
@@ -0,0 +1,364 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <span>
+#include <stdexcept>
+#include <thread>
+
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+    /* Shared with the children, done is only set if the child got to report a result */
+    struct result_slot {
+        run_result result;
+        bool done;
+    };
+
+    enum class Outcome {
+        Pass,
+        Fail,
+        Crash,
+    };
+
+    struct test_report {
+        Outcome outcome;
+        int exit_code;
+        uint64_t wall_ns;
+        std::string output;
+    };
+
+    struct running_test {
+        size_t idx;
+        int output_fd;
+        std::chrono::steady_clock::time_point begin;
+    };
+}
+
+static const char* outcome_name(Outcome outcome) {
+    switch (outcome) {
+        case Outcome::Pass:  return "pass";
+        case Outcome::Fail:  return "fail";
+        case Outcome::Crash: return "crash";
+    }
+
+    return "unknown";
+}
+
+static void write_perf_json(std::ostream& out, const run_result& result) {
+    bool first = true;
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+        const perf_count& count = result.perf[i];
+        if (!count.valid) {
+            continue;
+        }
+
+        out << (first ? ", \"perf\": { " : ", ")
+            << "\"" << perf_event_names[i] << "\": { \"guest\": " << count.guest
+            << ", \"handler\": " << count.handler << " }";
+        first = false;
+    }
+
+    if (!first) {
+        out << " }";
+    }
+}
+
+/* Print the summary and failures, and write the JSON report if requested */
+static int report_batch(const std::vector<std::string>& tests, const std::vector<test_report>& reports,
+                        std::span<const result_slot> slots, unsigned jobs, uint64_t batch_ns,
+                        const batch_options& opts) {
+    size_t passed = 0;
+    size_t failed = 0;
+    size_t crashed = 0;
+    uint64_t mismatches = 0;
+
+    for (size_t i = 0; i < tests.size(); ++i) {
+        const test_report& report = reports[i];
+
+        switch (report.outcome) {
+            case Outcome::Pass:  ++passed;  break;
+            case Outcome::Fail:  ++failed;  break;
+            case Outcome::Crash: ++crashed; break;
+        }
+
+        if (slots[i].done) {
+            mismatches += slots[i].result.mismatches;
+        }
+
+        if (report.outcome != Outcome::Pass) {
+            std::cerr << "FAIL " << tests[i] << " (" << outcome_name(report.outcome)
+                      << ", exit code " << report.exit_code << ")" << std::endl;
+            std::cerr << report.output;
+            if (!report.output.empty() && report.output.back() != '\n') {
+                std::cerr << std::endl;
+            }
+        }
+    }
+
+    std::cerr << passed << " passed, " << failed << " failed, " << crashed << " crashed ("
+              << mismatches << " register mismatches) in " << std::fixed << std::setprecision(3)
+              << (batch_ns / 1e9) << " s using " << jobs << " jobs" << std::endl;
+
+    if (!opts.json_path.empty()) {
+        std::ofstream out { opts.json_path };
+        if (!out) {
+            throw std::runtime_error("Could not open " + opts.json_path);
+        }
+
+        out << "{\n"
+            << "  \"passed\": " << passed << ",\n"
+            << "  \"failed\": " << failed << ",\n"
+            << "  \"crashed\": " << crashed << ",\n"
+            << "  \"mismatches\": " << mismatches << ",\n"
+            << "  \"jobs\": " << jobs << ",\n"
+            << "  \"wall_ns\": " << batch_ns << ",\n"
+            << "  \"tests\": [";
+
+        for (size_t i = 0; i < tests.size(); ++i) {
+            const test_report& report = reports[i];
+            const run_result& result = slots[i].result;
+
+            out << (i ? ",\n" : "\n")
+                << "    { \"test\": \"" << json_escape(tests[i]) << "\""
+                << ", \"outcome\": \"" << outcome_name(report.outcome) << "\""
+                << ", \"exit_code\": " << report.exit_code
+                << ", \"wall_ns\": " << report.wall_ns;
+
+            if (slots[i].done) {
+                out << ", \"guest_ns\": " << result.elapsed_ns
+                    << ", \"mismatches\": " << result.mismatches
+                    << ", \"mmio_traps\": " << result.mmio_traps;
+
+                if (result.raw_ns > 0) {
+                    out << ", \"raw_ns\": " << result.raw_ns
+                        << ", \"handler_ns\": " << result.handler_ns
+                        << ", \"pure_ns\": " << result.pure_ns;
+                }
+
+                write_perf_json(out, result);
+            }
+
+            out << " }";
+        }
+
+        out << "\n  ]\n}\n";
+    }
+
+    return (failed || crashed) ? ExitCodes::UnitTestFailed : ExitCodes::Success;
+}
+
+std::vector<std::string> collect_tests(const std::string& path) {
+    std::vector<std::string> res;
+
+    if (fs::is_directory(path)) {
+        for (const fs::directory_entry& entry : fs::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".conf") {
+                res.push_back(entry.path().string());
+            }
+        }
+
+        std::sort(res.begin(), res.end());
+    } else {
+        /* Manifest, one test per line relative to the manifest itself */
+        std::ifstream in { path };
+        if (!in) {
+            throw std::runtime_error("Could not open manifest " + path);
+        }
+
+        fs::path base = fs::path(path).parent_path();
+
+        for (std::string line; std::getline(in, line);) {
+            if (line.empty() || line.front() == '#') {
+                continue;
+            }
+
+            res.push_back(fs::path(line).is_absolute() ? line : (base / line).string());
+        }
+    }
+
+    if (res.empty()) {
+        throw std::runtime_error("No tests found in " + path);
+    }
+
+    return res;
+}
+
+int run_batch(const std::vector<std::string>& tests, const batch_options& opts, test_fn fn) {
+    unsigned jobs = opts.jobs ? opts.jobs : std::max(1u, std::thread::hardware_concurrency());
+
+    /* Do the one-time setup here, so every child inherits it instead of redoing it */
+    timer_frequency();
+
+    size_t slots_size = sizeof(result_slot) * tests.size();
+    void* slots_map = mmap(nullptr, slots_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots_map == MAP_FAILED) {
+        throw std::runtime_error(std::string("Mapping result slots failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    result_slot* slots = static_cast<result_slot*>(slots_map);
+
+    std::vector<test_report> reports(tests.size());
+    std::map<pid_t, running_test> running;
+
+    auto batch_begin = std::chrono::steady_clock::now();
+
+    size_t next = 0;
+    while (next < tests.size() || !running.empty()) {
+        while (next < tests.size() && running.size() < jobs) {
+            /* Capture everything the test prints, it's only shown if the test fails */
+            int output_fd = memfd_create("rv64-ume-test", MFD_CLOEXEC);
+            if (output_fd < 0) {
+                throw std::runtime_error(std::string("memfd_create failed: ") + strerror(errno));
+            }
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+            }
+
+            if (pid == 0) {
+                dup2(output_fd, STDOUT_FILENO);
+                dup2(output_fd, STDERR_FILENO);
+
+                int status = ExitCodes::AbnormalTermination;
+                try {
+                    slots[next].result = fn(tests[next]);
+                    slots[next].done = true;
+                    status = slots[next].result.status;
+                } catch (std::exception& e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                }
+
+                std::cout.flush();
+                _exit(status);
+            }
+
+            running.emplace(pid, running_test { next, output_fd, std::chrono::steady_clock::now() });
+            ++next;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("waitpid failed: ") + strerror(errno));
+        }
+
+        auto it = running.find(pid);
+        if (it == running.end()) {
+            continue;
+        }
+
+        const running_test& test = it->second;
+        test_report& report = reports[test.idx];
+
+        report.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - test.begin).count();
+        report.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+
+        if (!WIFEXITED(status) || !slots[test.idx].done) {
+            report.outcome = Outcome::Crash;
+        } else if (report.exit_code != ExitCodes::Success) {
+            report.outcome = Outcome::Fail;
+        } else {
+            report.outcome = Outcome::Pass;
+        }
+
+        if (report.outcome != Outcome::Pass) {
+            report.output = read_fd(test.output_fd);
+        }
+
+        close(test.output_fd);
+        running.erase(it);
+    }
+
+    auto batch_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - batch_begin).count();
+
+    try {
+        int res = report_batch(tests, reports, std::span(slots, tests.size()), jobs, batch_ns, opts);
+        munmap(slots_map, slots_size);
+        return res;
+    } catch (...) {
+        munmap(slots_map, slots_size);
+        throw;
+    }
+}
+
+int run_batch_threaded(const std::vector<std::string>& tests, const batch_options& opts, thread_test_fn fn) {
+    unsigned jobs = opts.jobs ? opts.jobs : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<size_t>(jobs, tests.size());
+
+    timer_frequency();
+
+    std::vector<result_slot> slots(tests.size());
+    std::vector<test_report> reports(tests.size());
+    std::atomic_size_t next = 0;
+
+    auto batch_begin = std::chrono::steady_clock::now();
+
+    auto worker = [&] {
+        for (size_t idx; (idx = next.fetch_add(1)) < tests.size();) {
+            test_report& report = reports[idx];
+            auto begin = std::chrono::steady_clock::now();
+
+            int output_fd = memfd_create("rv64-ume-test", MFD_CLOEXEC);
+            if (output_fd < 0) {
+                report.outcome = Outcome::Crash;
+                report.exit_code = ExitCodes::AbnormalTermination;
+                report.output = std::string("memfd_create failed: ") + strerror(errno) + "\n";
+                continue;
+            }
+
+            try {
+                slots[idx].result = fn(tests[idx], output_fd);
+                slots[idx].done = true;
+
+                report.exit_code = slots[idx].result.status;
+                report.outcome = report.exit_code == ExitCodes::Success ? Outcome::Pass : Outcome::Fail;
+            } catch (std::exception& e) {
+                std::string msg = std::string("Error: ") + e.what() + "\n";
+                write(output_fd, msg.data(), msg.size());
+
+                report.exit_code = ExitCodes::AbnormalTermination;
+                report.outcome = Outcome::Crash;
+            }
+
+            report.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - begin).count();
+
+            if (report.outcome != Outcome::Pass) {
+                report.output = read_fd(output_fd);
+            }
+
+            close(output_fd);
+        }
+    };
+
+    {
+        std::vector<std::jthread> threads;
+        for (unsigned i = 0; i < jobs; ++i) {
+            threads.emplace_back(worker);
+        }
+    }
+
+    auto batch_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - batch_begin).count();
+
+    return report_batch(tests, reports, slots, jobs, batch_ns, opts);
+}
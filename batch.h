@@ -0,0 +1,33 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+struct batch_options {
+    /* 0 means one per core */
+    unsigned jobs = 0;
+
+    /* Empty for no JSON output */
+    std::string json_path;
+};
+
+/* Runs a single test, called in a freshly forked child */
+using test_fn = std::function<run_result(const std::string& test)>;
+
+/* All .conf files below a directory, or the ones listed in a manifest file */
+std::vector<std::string> collect_tests(const std::string& path);
+
+/* Run every test in a separate child, returns the exit code for the whole batch */
+int run_batch(const std::vector<std::string>& tests, const batch_options& opts, test_fn fn);
+
+/* Runs a single test on the calling thread, writing anything it prints to output_fd */
+using thread_test_fn = std::function<run_result(const std::string& test, int output_fd)>;
+
+/* Same as run_batch but with jobs threads in this process, a crashing test takes down the batch */
+int run_batch_threaded(const std::vector<std::string>& tests, const batch_options& opts, thread_test_fn fn);
+
+#endif /* BATCH_H */
@@ -0,0 +1,251 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+namespace {
+    /* Shared with the child, done is only set if it got to report a result */
+    struct result_slot {
+        run_result result;
+        bool done;
+    };
+
+    struct bench_stats {
+        double min;
+        double median;
+        double mean;
+        double p95;
+        double p99;
+        double max;
+        double stddev;
+    };
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const std::vector<double>& sorted, double pct) {
+    size_t rank = static_cast<size_t>(std::ceil(pct / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+static bench_stats compute_stats(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+
+    size_t n = samples.size();
+    double mean = std::accumulate(samples.begin(), samples.end(), 0.0) / n;
+
+    double variance = 0;
+    for (double sample : samples) {
+        variance += (sample - mean) * (sample - mean);
+    }
+
+    return bench_stats {
+        .min = samples.front(),
+        .median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2,
+        .mean = mean,
+        .p95 = percentile(samples, 95),
+        .p99 = percentile(samples, 99),
+        .max = samples.back(),
+        .stddev = n > 1 ? std::sqrt(variance / (n - 1)) : 0.0,
+    };
+}
+
+static void write_stats_json(std::ostream& out, const bench_stats& stats) {
+    out << "{ \"min\": " << stats.min
+        << ", \"median\": " << stats.median
+        << ", \"mean\": " << stats.mean
+        << ", \"p95\": " << stats.p95
+        << ", \"p99\": " << stats.p99
+        << ", \"max\": " << stats.max
+        << ", \"stddev\": " << stats.stddev << " }";
+}
+
+/* Median guest time of an earlier report, only understands what write_report produces */
+static double read_baseline_median(const std::string& path) {
+    std::ifstream in { path };
+    if (!in) {
+        throw std::runtime_error("Could not open baseline " + path);
+    }
+
+    std::stringstream buf;
+    buf << in.rdbuf();
+    std::string json = buf.str();
+
+    size_t section = json.find("\"guest_ns\"");
+    size_t key = section == std::string::npos ? section : json.find("\"median\":", section);
+    if (key == std::string::npos) {
+        throw std::runtime_error("No guest_ns median in baseline " + path);
+    }
+
+    return std::strtod(json.c_str() + key + strlen("\"median\":"), nullptr);
+}
+
+/* Fork one child running fn, with its output discarded */
+static run_result run_child(result_slot* slot, const bench_fn& fn) {
+    slot->done = false;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+
+        int status = ExitCodes::AbnormalTermination;
+        try {
+            slot->result = fn();
+            slot->done = true;
+            status = slot->result.status;
+        } catch (std::exception&) {
+        }
+
+        std::cout.flush();
+        _exit(status);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("waitpid failed: ") + strerror(errno));
+        }
+    }
+
+    if (!WIFEXITED(status) || !slot->done) {
+        throw std::runtime_error("Benchmark run crashed (run it on its own to see why)");
+    }
+
+    if (slot->result.status != ExitCodes::Success) {
+        throw std::runtime_error("Benchmark run failed with exit code " + std::to_string(slot->result.status));
+    }
+
+    return slot->result;
+}
+
+int run_benchmark(const std::string& name, const bench_options& opts, bench_fn fn) {
+    if (opts.runs == 0) {
+        throw std::runtime_error("Benchmarking needs at least one run");
+    }
+
+    /* Do the one-time setup here, so every child inherits it instead of redoing it */
+    timer_frequency();
+
+    void* slot_map = mmap(nullptr, sizeof(result_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slot_map == MAP_FAILED) {
+        throw std::runtime_error(std::string("Mapping result slot failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    result_slot* slot = static_cast<result_slot*>(slot_map);
+
+    std::vector<double> guest_ns;
+    std::vector<double> pure_ns;
+    std::vector<double> traps;
+
+    try {
+        for (unsigned i = 0; i < opts.warmup + opts.runs; ++i) {
+            run_result res = run_child(slot, fn);
+
+            if (i >= opts.warmup) {
+                guest_ns.push_back(res.elapsed_ns);
+                pure_ns.push_back(res.pure_ns);
+                traps.push_back(res.mmio_traps);
+            }
+        }
+    } catch (...) {
+        munmap(slot_map, sizeof(result_slot));
+        throw;
+    }
+
+    munmap(slot_map, sizeof(result_slot));
+
+    bench_stats time = compute_stats(guest_ns);
+    bench_stats pure = compute_stats(pure_ns);
+    bench_stats trap = compute_stats(traps);
+
+    std::cerr << std::fixed << std::setprecision(3)
+              << "Benchmark: " << opts.runs << " runs after " << opts.warmup << " warmup runs\n"
+              << "  guest time (us): min " << time.min / 1e3 << ", median " << time.median / 1e3
+              << ", mean " << time.mean / 1e3 << ", p95 " << time.p95 / 1e3 << ", p99 " << time.p99 / 1e3
+              << ", stddev " << time.stddev / 1e3 << " (" << (100.0 * time.stddev / time.mean) << "%)\n"
+              << "  without traps (us): min " << pure.min / 1e3 << ", median " << pure.median / 1e3
+              << ", mean " << pure.mean / 1e3 << ", stddev " << pure.stddev / 1e3 << "\n"
+              << std::setprecision(0)
+              << "  MMIO traps: min " << trap.min << ", median " << trap.median << ", max " << trap.max
+              << std::endl;
+
+    int res = ExitCodes::Success;
+    double baseline = 0;
+    double change_pct = 0;
+
+    if (!opts.baseline_path.empty()) {
+        baseline = read_baseline_median(opts.baseline_path);
+        change_pct = baseline > 0 ? 100.0 * (time.median - baseline) / baseline : 0.0;
+
+        std::cerr << std::setprecision(2) << "  median " << (change_pct >= 0 ? "+" : "") << change_pct
+                  << "% against the baseline (threshold " << opts.threshold_pct << "%)" << std::endl;
+
+        if (change_pct > opts.threshold_pct) {
+            std::cerr << "Regression: median guest time went from " << std::setprecision(3) << baseline / 1e3
+                      << " us to " << time.median / 1e3 << " us" << std::endl;
+            res = ExitCodes::BenchmarkRegression;
+        }
+    }
+
+    std::cerr << std::defaultfloat;
+
+    if (!opts.json_path.empty()) {
+        std::ofstream out { opts.json_path };
+        if (!out) {
+            throw std::runtime_error("Could not open " + opts.json_path);
+        }
+
+        out << std::fixed << std::setprecision(1)
+            << "{\n"
+            << "  \"executable\": \"" << json_escape(name) << "\",\n"
+            << "  \"runs\": " << opts.runs << ",\n"
+            << "  \"warmup\": " << opts.warmup << ",\n"
+            << "  \"guest_ns\": ";
+        write_stats_json(out, time);
+
+        out << ",\n  \"pure_ns\": ";
+        write_stats_json(out, pure);
+
+        out << ",\n  \"mmio_traps\": ";
+        write_stats_json(out, trap);
+
+        if (!opts.baseline_path.empty()) {
+            out << ",\n  \"baseline\": { \"median\": " << baseline
+                << ", \"change_pct\": " << std::setprecision(3) << change_pct
+                << ", \"threshold_pct\": " << opts.threshold_pct
+                << ", \"regression\": " << (res == ExitCodes::BenchmarkRegression ? "true" : "false") << " }"
+                << std::setprecision(1);
+        }
+
+        out << ",\n  \"samples_ns\": [";
+        for (size_t i = 0; i < guest_ns.size(); ++i) {
+            out << (i ? ", " : " ") << static_cast<uint64_t>(guest_ns[i]);
+        }
+        out << " ]\n}\n";
+    }
+
+    return res;
+}
@@ -0,0 +1,32 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <functional>
+#include <string>
+
+#include "util.h"
+
+struct bench_options {
+    /* Measured runs, 0 when not benchmarking */
+    unsigned runs = 0;
+    unsigned warmup = 1;
+
+    /* Empty for no JSON output */
+    std::string json_path;
+
+    /* A previous JSON report to compare the median guest time against */
+    std::string baseline_path;
+    double threshold_pct = 5.0;
+};
+
+/* Runs the guest once, called in a freshly forked child */
+using bench_fn = std::function<run_result()>;
+
+/**
+ * Run the guest warmup + runs times, each in a fresh child so the fixed address mappings
+ * start out the same every time, and report statistics over the measured runs. Returns
+ * BenchmarkRegression if the median is more than the threshold slower than the baseline
+ */
+int run_benchmark(const std::string& name, const bench_options& opts, bench_fn fn);
+
+#endif /* BENCH_H */
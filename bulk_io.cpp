@@ -0,0 +1,116 @@
+#include "bulk_io.h"
+
+#include <cerrno>
+
+#include "util.h"
+
+BulkIO::BulkIO(Serial* serial) : _serial { serial } {
+
+}
+
+void BulkIO::set_output(int out, int err) {
+    _out = out;
+    _err = err;
+}
+
+void BulkIO::reset() {
+    _addr = 0;
+    _len = 0;
+    _status = 0;
+    _transfers = 0;
+    _bytes = 0;
+}
+
+bool BulkIO::handle_write(uintptr_t addr, uint8_t size, uint64_t val) {
+    if (!owns(addr)) {
+        return false;
+    }
+
+    if ((size != 4 && size != 8) || (addr & 7)) crash_and_burn("unexpected access size for bulk IO");
+
+    switch (addr) {
+        case bulk_addr_reg:   _addr = val; break;
+        case bulk_len_reg:    _len = val; break;
+        case bulk_cmd_reg:    _status = _transfer(val); break;
+
+        /* Read-only */
+        default:              return false;
+    }
+
+    return true;
+}
+
+bool BulkIO::handle_read(uintptr_t addr, uint8_t size, uint64_t& val) const {
+    if (!owns(addr)) {
+        return false;
+    }
+
+    if ((size != 4 && size != 8) || (addr & 7)) crash_and_burn("unexpected access size for bulk IO");
+
+    switch (addr) {
+        case bulk_addr_reg:   val = _addr; break;
+        case bulk_len_reg:    val = _len; break;
+        case bulk_status_reg: val = static_cast<uint64_t>(_status); break;
+        default:              return false;
+    }
+
+    return true;
+}
+
+uint64_t BulkIO::transfers() const {
+    return _transfers;
+}
+
+uint64_t BulkIO::bytes() const {
+    return _bytes;
+}
+
+int64_t BulkIO::_transfer(uint64_t cmd) {
+    char* buf = reinterpret_cast<char*>(_addr);
+    uint64_t done = 0;
+
+    switch (cmd) {
+        case BulkWriteStdout:
+        case BulkWriteStderr: {
+            int fd = cmd == BulkWriteStdout ? _out : _err;
+
+            /* Serial output may go to the same place, anything written before this comes first */
+            _serial->drain();
+
+            while (done < _len) {
+                ssize_t res = write(fd, buf + done, _len - done);
+                if (res < 0) {
+                    if (errno == EINTR) continue;
+                    if (done == 0) return -errno;
+                    break;
+                }
+
+                done += res;
+            }
+            break;
+        }
+
+        case BulkReadStdin: {
+            /* Like read(2), may return less than asked for, 0 at end of file */
+            ssize_t res;
+            do {
+                res = read(_in, buf, _len);
+            } while (res < 0 && errno == EINTR);
+
+            if (res < 0) {
+                return -errno;
+            }
+
+            done = res;
+            break;
+        }
+
+        default:
+            return -EINVAL;
+    }
+
+    _transfers.fetch_add(1, std::memory_order_relaxed);
+    _bytes.fetch_add(done, std::memory_order_relaxed);
+
+    return done;
+}
@@ -0,0 +1,73 @@
+#ifndef BULK_IO_H
+#define BULK_IO_H
+
+#include <atomic>
+
+#include <cstdint>
+
+#include <unistd.h>
+
+#include "serial.h"
+
+/**
+ * Moves a whole guest buffer with a single trap, instead of one trap per byte through
+ * the serial register. All registers are 4 or 8 bytes wide:
+ * - 0x280 BULK_ADDR:   guest address of the buffer
+ * - 0x288 BULK_LEN:    its length in bytes
+ * - 0x290 BULK_CMD:    writing a command performs it right away, see BulkCommands
+ * - 0x298 BULK_STATUS: bytes transferred by the last command, or -errno if it failed
+ * The transfer happens in place on guest memory, so a bad buffer just gives -EFAULT.
+ */
+static constexpr uintptr_t bulk_io_addr = 0x280;
+static constexpr uintptr_t bulk_addr_reg = bulk_io_addr;
+static constexpr uintptr_t bulk_len_reg = bulk_io_addr + 0x08;
+static constexpr uintptr_t bulk_cmd_reg = bulk_io_addr + 0x10;
+static constexpr uintptr_t bulk_status_reg = bulk_io_addr + 0x18;
+static constexpr uintptr_t bulk_io_end = bulk_io_addr + 0x20;
+
+enum BulkCommands : uint64_t {
+    BulkWriteStdout = 1,
+    BulkWriteStderr = 2,
+    BulkReadStdin = 3,
+};
+
+class BulkIO {
+    /* Flushed before writing to stdout, so both kinds of output stay in order */
+    Serial* _serial;
+
+    uint64_t _addr = 0;
+    uint64_t _len = 0;
+    int64_t _status = 0;
+
+    int _out = STDOUT_FILENO;
+    int _err = STDERR_FILENO;
+    int _in = STDIN_FILENO;
+
+    std::atomic_uint64_t _transfers{};
+    std::atomic_uint64_t _bytes{};
+
+    public:
+    explicit BulkIO(Serial* serial);
+
+    static bool owns(uintptr_t addr) {
+        return addr >= bulk_io_addr && addr < bulk_io_end;
+    }
+
+    /* Defaults to stdout and stderr */
+    void set_output(int out, int err);
+
+    /* Clears the registers between runs */
+    void reset();
+
+    /* Return true if handled, signal-safe */
+    bool handle_write(uintptr_t addr, uint8_t size, uint64_t val);
+    bool handle_read(uintptr_t addr, uint8_t size, uint64_t& val) const;
+
+    uint64_t transfers() const;
+    uint64_t bytes() const;
+
+    private:
+    int64_t _transfer(uint64_t cmd);
+};
+
+#endif /* BULK_IO_H */
@@ -0,0 +1,250 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static bool all_zero(const void* page) {
+    const uint64_t* words = static_cast<const uint64_t*>(page);
+
+    for (size_t i = 0; i < checkpoint_page_size / sizeof(uint64_t); ++i) {
+        if (words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size, uint64_t offset) {
+    const char* bytes = static_cast<const char*>(data);
+
+    while (size > 0) {
+        ssize_t res = pwrite(fd, bytes, size, offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (res <= 0) {
+            return false;
+        }
+
+        bytes += res;
+        size -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+Checkpointer::Checkpointer(const std::string& path, const elf_file& elf)
+    : _path { path }, _tmp_path { path + ".tmp" }, _entry { elf.entry() } {
+    for (const safe_map& program : elf.programs()) {
+        if (program.prot() & PROT_EXEC) {
+            _code.push_back(elf_section { reinterpret_cast<uintptr_t>(program.map()), program.size() });
+        }
+
+        if (program.prot() & PROT_WRITE) {
+            _programs.push_back(checkpoint_region {
+                .addr = reinterpret_cast<uintptr_t>(program.map()),
+                .size = program.size(),
+                .offset = 0,
+                .prot = static_cast<uint32_t>(program.prot()),
+                .kind = CheckpointProgram,
+            });
+        }
+    }
+
+    /* Leave room for the framebuffer */
+    if (_programs.size() + 2 > max_checkpoint_regions) {
+        throw std::runtime_error("Too many writable segments to checkpoint");
+    }
+}
+
+bool Checkpointer::save(const ucontext_t* ctx, std::span<const checkpoint_region> extra) {
+    _pending = false;
+
+    checkpoint_header header { };
+    std::copy(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic);
+    header.version = checkpoint_version;
+    header.entry = _entry;
+
+    std::copy_n(ctx->uc_mcontext.__gregs, 32, header.gregs);
+    std::copy_n(ctx->uc_mcontext.__fpregs.__d.__f, 32, header.fregs);
+    header.fcsr = ctx->uc_mcontext.__fpregs.__d.__fcsr;
+
+    int fd = open(_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+
+    uint64_t offset = checkpoint_page_size;
+    auto add = [&](const checkpoint_region& region) {
+        if (!ok || header.num_regions == max_checkpoint_regions) {
+            ok = false;
+            return;
+        }
+
+        checkpoint_region& saved = header.regions[header.num_regions++];
+        saved = region;
+        saved.size = (region.size + checkpoint_page_size - 1) & ~(checkpoint_page_size - 1);
+        saved.offset = offset;
+
+        /* Mappings cover whole pages, whatever the size says */
+        for (uint64_t pos = 0; ok && pos < saved.size; pos += checkpoint_page_size) {
+            const void* page = reinterpret_cast<const void*>(region.addr + pos);
+
+            if (!all_zero(page)) {
+                ok = write_all(fd, page, checkpoint_page_size, offset + pos);
+            }
+        }
+
+        offset += saved.size;
+    };
+
+    for (const checkpoint_region& region : _programs) {
+        add(region);
+    }
+
+    for (const checkpoint_region& region : extra) {
+        add(region);
+    }
+
+    /* Extends the file over any trailing holes, then the header makes it valid */
+    ok = ok && ftruncate(fd, offset) == 0;
+    ok = ok && write_all(fd, &header, sizeof(header), 0);
+
+    int err = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    ok = ok && rename(_tmp_path.c_str(), _path.c_str()) == 0;
+
+    if (ok) {
+        _saved += 1;
+    } else {
+        _error = err ? err : errno;
+        _failed += 1;
+    }
+
+    return ok;
+}
+
+bool Checkpointer::in_guest_code(uintptr_t pc) const {
+    return std::any_of(_code.begin(), _code.end(), [pc](const elf_section& code) {
+        return pc >= code.addr && pc < code.addr + code.size;
+    });
+}
+
+void Checkpointer::defer() {
+    _pending = true;
+}
+
+bool Checkpointer::pending() const {
+    return _pending;
+}
+
+uint64_t Checkpointer::saved() const {
+    return _saved;
+}
+
+uint64_t Checkpointer::failed() const {
+    return _failed;
+}
+
+int Checkpointer::error() const {
+    return _error;
+}
+
+const std::string& Checkpointer::path() const {
+    return _path;
+}
+
+CheckpointImage::CheckpointImage(const std::string& path) {
+    _fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+        throw std::runtime_error("Could not open checkpoint " + path + ": " + strerror(errno));
+    }
+
+    if (pread(_fd, &_header, sizeof(_header), 0) != sizeof(_header)
+            || !std::equal(std::begin(checkpoint_magic), std::end(checkpoint_magic), _header.magic)
+            || _header.version != checkpoint_version
+            || _header.num_regions > max_checkpoint_regions) {
+        close(_fd);
+        throw std::runtime_error(path + " is not a checkpoint");
+    }
+}
+
+CheckpointImage::~CheckpointImage() {
+    close(_fd);
+}
+
+void CheckpointImage::restore_programs(const elf_file& elf) {
+    if (_header.entry != elf.entry()) {
+        throw std::runtime_error("Checkpoint was taken from a different executable");
+    }
+
+    for (const checkpoint_region& region : std::span(_header.regions, _header.num_regions)) {
+        if (region.kind != CheckpointProgram) {
+            continue;
+        }
+
+        auto programs = elf.programs();
+        bool matches = std::any_of(programs.begin(), programs.end(), [&region](const safe_map& program) {
+            return reinterpret_cast<uintptr_t>(program.map()) == region.addr
+                && ((program.size() + checkpoint_page_size - 1) & ~(checkpoint_page_size - 1)) == region.size
+                && static_cast<uint32_t>(program.prot()) == region.prot;
+        });
+
+        if (!matches) {
+            throw std::runtime_error("Checkpoint doesn't match the executable's segments");
+        }
+
+        /* Replaces the segment in place, elf still unmaps it */
+        void* target = reinterpret_cast<void*>(region.addr);
+        void* map = mmap(target, region.size, region.prot, MAP_PRIVATE | MAP_FIXED, _fd, region.offset);
+
+        if (map != target) {
+            throw std::runtime_error(std::string("Mapping checkpoint failed: ")
+                    + strerrorname_np(errno) + " - " + strerror(errno));
+        }
+    }
+}
+
+bool CheckpointImage::restore_regions(uint32_t kind) {
+    bool found = false;
+
+    for (const checkpoint_region& region : std::span(_header.regions, _header.num_regions)) {
+        if (region.kind != kind) {
+            continue;
+        }
+
+        char* target = reinterpret_cast<char*>(region.addr);
+        for (uint64_t done = 0; done < region.size;) {
+            ssize_t res = pread(_fd, target + done, region.size - done, region.offset + done);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (res <= 0) {
+                throw std::runtime_error(std::string("Reading checkpoint failed: ") + strerror(errno));
+            }
+
+            done += res;
+        }
+
+        found = true;
+    }
+
+    return found;
+}
+
+const checkpoint_header& CheckpointImage::header() const {
+    return _header;
+}
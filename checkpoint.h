@@ -0,0 +1,137 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <atomic>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/ucontext.h>
+
+#include "elf_file.h"
+
+/* Writing takes a checkpoint and resumes after the store, reading gives 1 in a restored guest */
+static constexpr uintptr_t checkpoint_addr = 0x2f8;
+
+/**
+ * Checkpoint file layout: a page holding the checkpoint_header, then the saved regions
+ * back to back, each page aligned. Pages that were all zero are left as holes, so the
+ * file only takes up space for memory the guest actually used. Restoring maps the
+ * program regions straight from the file, copy-on-write.
+ */
+static constexpr char checkpoint_magic[8] = { 'R', 'V', 'C', 'K', 'P', 'T', 0, 0 };
+static constexpr uint32_t checkpoint_version = 1;
+static constexpr size_t checkpoint_page_size = 4096;
+static constexpr size_t max_checkpoint_regions = 16;
+
+enum CheckpointRegions : uint32_t {
+    /* A writable segment of the executable */
+    CheckpointProgram = 0,
+    /* Framebuffer pixels or the shared register page, only restored when there is a display */
+    CheckpointFramebuffer,
+};
+
+struct checkpoint_region {
+    uint64_t addr;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t prot;
+    uint32_t kind;
+};
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_regions;
+
+    /* Of the executable the checkpoint was taken from, checked when restoring */
+    uint64_t entry;
+
+    /* Same layout as __riscv_mc_gp_state, so pc comes first */
+    uint64_t gregs[32];
+    uint64_t fregs[32];
+    uint32_t fcsr;
+    uint32_t reserved;
+
+    checkpoint_region regions[max_checkpoint_regions];
+};
+
+static_assert(sizeof(checkpoint_header) <= checkpoint_page_size);
+
+/* Writes checkpoints of one guest, set up before it starts */
+class Checkpointer {
+    std::string _path;
+
+    /* Written first and renamed over _path, so a checkpoint is never half written */
+    std::string _tmp_path;
+
+    uint64_t _entry;
+    std::vector<checkpoint_region> _programs;
+
+    /* Executable segments, where the guest's own code runs */
+    std::vector<elf_section> _code;
+
+    /* Requested while the guest wasn't in its own code, taken at the next trap */
+    std::atomic_bool _pending{};
+
+    std::atomic_uint64_t _saved{};
+    std::atomic_uint64_t _failed{};
+    std::atomic_int _error{};
+
+    public:
+    /* Covers the writable segments of elf */
+    Checkpointer(const std::string& path, const elf_file& elf);
+
+    /**
+     * Write the guest state in ctx and the writable segments, plus extra regions such as
+     * the framebuffer. Called from the trap handler on the guest's thread, doesn't
+     * allocate. Failures are counted, not fatal
+     */
+    bool save(const ucontext_t* ctx, std::span<const checkpoint_region> extra);
+
+    /**
+     * Whether pc is in the executable's segments. Anywhere else (patched stores, tracer
+     * trampolines, device handlers) the registers are the host's and not worth saving
+     */
+    bool in_guest_code(uintptr_t pc) const;
+
+    /* Remember a request until save() is called. Signal-safe */
+    void defer();
+    bool pending() const;
+
+    uint64_t saved() const;
+    uint64_t failed() const;
+
+    /* errno of the last failed save */
+    int error() const;
+
+    const std::string& path() const;
+};
+
+/* A checkpoint file opened for restoring */
+class CheckpointImage {
+    int _fd = -1;
+    checkpoint_header _header;
+
+    public:
+    /* Throws if path isn't a checkpoint */
+    explicit CheckpointImage(const std::string& path);
+    ~CheckpointImage();
+
+    CheckpointImage(const CheckpointImage&) = delete;
+    CheckpointImage& operator=(const CheckpointImage&) = delete;
+
+    /* Map the saved segments over elf's writable ones, throws if they don't match */
+    void restore_programs(const elf_file& elf);
+
+    /* Copy the saved regions of kind back into memory that is already mapped, false if there are none */
+    bool restore_regions(uint32_t kind);
+
+    /* Registers to resume with */
+    const checkpoint_header& header() const;
+};
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,225 @@
+#include "coverage.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "basic_blocks.h"
+
+namespace {
+    struct lcov_function {
+        uint64_t line;
+        uint64_t count;
+    };
+
+    /* What we write for one source file, other record types are dropped when merging */
+    struct lcov_record {
+        std::map<std::string, lcov_function> functions;
+        std::map<uint64_t, uint64_t> lines;
+    };
+}
+
+using lcov_data = std::map<std::string, lcov_record>;
+
+static void parse_lcov(const std::string& text, lcov_data& data) {
+    std::istringstream in { text };
+    lcov_record* record = nullptr;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t colon = line.find(':');
+        std::string key = line.substr(0, colon);
+        std::string value = colon == std::string::npos ? "" : line.substr(colon + 1);
+        size_t comma = value.find(',');
+
+        if (key == "SF") {
+            record = &data[value];
+        } else if (key == "end_of_record") {
+            record = nullptr;
+        } else if (!record || comma == std::string::npos) {
+            continue;
+        } else if (key == "FN") {
+            record->functions[value.substr(comma + 1)].line = std::stoull(value.substr(0, comma));
+        } else if (key == "FNDA") {
+            record->functions[value.substr(comma + 1)].count += std::stoull(value.substr(0, comma));
+        } else if (key == "DA") {
+            record->lines[std::stoull(value.substr(0, comma))] += std::stoull(value.substr(comma + 1));
+        }
+    }
+}
+
+static std::string format_lcov(const lcov_data& data) {
+    std::ostringstream out;
+
+    for (const auto& [source, record] : data) {
+        out << "TN:\nSF:" << source << "\n";
+
+        for (const auto& [name, fn] : record.functions) {
+            out << "FN:" << fn.line << "," << name << "\n";
+        }
+
+        uint64_t functions_hit = 0;
+        for (const auto& [name, fn] : record.functions) {
+            out << "FNDA:" << fn.count << "," << name << "\n";
+            functions_hit += fn.count > 0;
+        }
+
+        out << "FNF:" << record.functions.size() << "\nFNH:" << functions_hit << "\n";
+
+        uint64_t lines_hit = 0;
+        for (const auto& [line, count] : record.lines) {
+            out << "DA:" << line << "," << count << "\n";
+            lines_hit += count > 0;
+        }
+
+        out << "LF:" << record.lines.size() << "\nLH:" << lines_hit << "\nend_of_record\n";
+    }
+
+    return out.str();
+}
+
+void Coverage::instrument(const elf_file& elf) {
+    _blocks.clear();
+    _covered = 0;
+
+    for (const safe_map& program : elf.programs()) {
+        if (!(program.prot() & PROT_EXEC)) {
+            continue;
+        }
+
+        /* Segments without code sections are left alone, not even made writable */
+        std::vector<basic_block> found = find_basic_blocks(elf, program);
+        if (found.empty()) {
+            continue;
+        }
+
+        plant_breakpoints(program, found);
+
+        for (const basic_block& b : found) {
+            _blocks.push_back(block { b.pc, b.original, b.length, false, program.prot() });
+        }
+    }
+
+    std::sort(_blocks.begin(), _blocks.end(), [](const block& a, const block& b) { return a.pc < b.pc; });
+}
+
+void Coverage::remove() {
+    for (const block& b : _blocks) {
+        if (!b.hit) {
+            write_instruction(b.pc, b.original, b.length, b.prot);
+        }
+    }
+}
+
+bool Coverage::hit(ucontext_t* ctx) {
+    uintptr_t pc = ctx->uc_mcontext.__gregs[REG_PC];
+
+    auto it = std::lower_bound(_blocks.begin(), _blocks.end(), pc,
+                               [](const block& b, uintptr_t pc) { return b.pc < pc; });
+
+    if (it == _blocks.end() || it->pc != pc || it->hit) {
+        return false;
+    }
+
+    /* PC stays put, so the guest continues with the original instruction */
+    write_instruction(it->pc, it->original, it->length, it->prot);
+    it->hit = true;
+    _covered += 1;
+
+    return true;
+}
+
+void Coverage::write_lcov(const std::string& path, const elf_file& elf) const {
+    lcov_record ours;
+
+    for (const elf_symbol& sym : elf.symbols()) {
+        ours.functions[sym.name] = lcov_function { sym.addr, 0 };
+    }
+
+    for (const block& b : _blocks) {
+        ours.lines[b.pc] = b.hit;
+
+        if (const elf_symbol* sym = b.hit ? elf.find_symbol(b.pc) : nullptr) {
+            ours.functions[sym->name].count = 1;
+        }
+    }
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open coverage file " + path + ": " + strerror(errno));
+    }
+
+    /* Held until close, other runs of the batch wait here */
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not lock coverage file " + path + ": " + strerror(errno));
+    }
+
+    std::string text;
+    char buf[4096];
+    ssize_t res;
+    while ((res = read(fd, buf, sizeof(buf))) > 0 || (res < 0 && errno == EINTR)) {
+        text.append(buf, std::max<ssize_t>(res, 0));
+    }
+
+    lcov_data data;
+    try {
+        parse_lcov(text, data);
+    } catch (const std::exception&) {
+        close(fd);
+        throw std::runtime_error("Could not parse coverage file " + path);
+    }
+
+    lcov_record& record = data[elf.path()];
+    for (const auto& [name, fn] : ours.functions) {
+        record.functions[name].line = fn.line;
+        record.functions[name].count += fn.count;
+    }
+
+    for (const auto& [line, count] : ours.lines) {
+        record.lines[line] += count;
+    }
+
+    text = format_lcov(data);
+
+    bool ok = ftruncate(fd, 0) == 0;
+    for (size_t done = 0; ok && done < text.size();) {
+        ssize_t written = pwrite(fd, text.data() + done, text.size() - done, done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ok = written > 0;
+        done += std::max<ssize_t>(written, 0);
+    }
+
+    int err = errno;
+    close(fd);
+
+    if (!ok) {
+        throw std::runtime_error("Could not write coverage file " + path + ": " + strerror(err));
+    }
+}
+
+void Coverage::print_summary(std::ostream& out, const elf_file& elf) const {
+    std::set<const elf_symbol*> functions;
+    for (const block& b : _blocks) {
+        if (const elf_symbol* sym = b.hit ? elf.find_symbol(b.pc) : nullptr) {
+            functions.insert(sym);
+        }
+    }
+
+    out << std::dec << "Coverage: " << _covered << " of " << _blocks.size() << " blocks ("
+        << (_blocks.empty() ? 0.0 : 100.0 * _covered / _blocks.size()) << "%), " << functions.size()
+        << " of " << elf.symbols().size() << " functions" << std::endl;
+}
@@ -0,0 +1,60 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/ucontext.h>
+
+#include "elf_file.h"
+
+/**
+ * Which basic blocks the guest reached. Like the tracer, the first instruction of every
+ * block is replaced by an ebreak, but the handler puts the original back on the first
+ * hit and lets the guest run it, so every block traps at most once and covered code
+ * runs at full speed afterwards.
+ *
+ * Results go out in lcov's tracefile format, with the executable as the source file
+ * and guest addresses in place of line numbers: a DA line per block and an FN/FNDA
+ * pair per symbol. Counts are the number of runs that reached the block, as runs
+ * writing to the same file are merged.
+ */
+class Coverage {
+    struct block {
+        uintptr_t pc;
+        uint32_t original;
+        uint8_t length;
+        bool hit;
+        int prot;
+    };
+
+    /* Sorted by pc, never resized while the guest runs so the handler can search it */
+    std::vector<block> _blocks;
+
+    uint64_t _covered = 0;
+
+    public:
+    Coverage() = default;
+
+    Coverage(const Coverage&) = delete;
+    Coverage& operator=(const Coverage&) = delete;
+
+    /* Find the blocks in elf's code sections and plant the breakpoints */
+    void instrument(const elf_file& elf);
+
+    /* Put back the original of every block that wasn't reached, keeps the results */
+    void remove();
+
+    /* Called from the SIGTRAP handler, false if the breakpoint isn't one of ours. Signal-safe */
+    bool hit(ucontext_t* ctx);
+
+    /* Merge into the tracefile at path, locked so parallel batch runs can share it */
+    void write_lcov(const std::string& path, const elf_file& elf) const;
+
+    void print_summary(std::ostream& out, const elf_file& elf) const;
+};
+
+#endif /* COVERAGE_H */
@@ -0,0 +1,301 @@
+#include "daemon.h"
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Parsed images kept around, least recently used ones are dropped beyond this */
+static constexpr size_t max_cached_images = 64;
+
+/* Don't let a client that never finishes its request line block everyone else */
+static constexpr timeval request_timeout { .tv_sec = 1, .tv_usec = 0 };
+static constexpr size_t max_request_size = 64 * 1024;
+
+namespace {
+    struct cached_image {
+        std::unique_ptr<elf_file> elf;
+        struct stat st;
+        uint64_t last_used;
+    };
+
+    struct request {
+        std::string executable;
+        std::vector<reg_init> pre;
+        std::vector<reg_init> post;
+    };
+}
+
+static bool same_file(const struct stat& a, const struct stat& b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+/* Parsed and mapped image for path, (re)loading it if it's new or changed on disk */
+static const elf_file& get_image(std::map<std::string, cached_image>& images, const std::string& path,
+                                 uint64_t now) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        throw std::runtime_error("Could not stat " + path);
+    }
+
+    auto it = images.find(path);
+    if (it != images.end() && !same_file(it->second.st, st)) {
+        images.erase(it);
+        it = images.end();
+    }
+
+    if (it == images.end()) {
+        if (images.size() >= max_cached_images) {
+            auto oldest = images.begin();
+            for (auto i = images.begin(); i != images.end(); ++i) {
+                if (i->second.last_used < oldest->second.last_used) {
+                    oldest = i;
+                }
+            }
+
+            images.erase(oldest);
+        }
+
+        it = images.emplace(path, cached_image { std::make_unique<elf_file>(path, false), st, now }).first;
+    }
+
+    it->second.last_used = now;
+    elf_file& elf = *it->second.elf;
+
+    if (!elf.loaded()) {
+        try {
+            elf.load();
+        } catch (std::exception&) {
+            /* Most likely overlaps with another cached image, make room and retry */
+            for (auto& [other_path, other] : images) {
+                if (other.elf.get() != &elf) {
+                    other.elf->unload();
+                }
+            }
+
+            elf.load();
+        }
+    }
+
+    return elf;
+}
+
+static request parse_request(const std::string& line) {
+    std::istringstream in { line };
+
+    std::string command;
+    std::string target;
+    if (!(in >> command >> target)) {
+        throw std::invalid_argument("Expected '<run|test> <path> [reginit...]'");
+    }
+
+    request res;
+
+    if (command == "test") {
+        load_conf(target, res.pre, res.post);
+        res.executable = test_executable(target);
+    } else if (command == "run") {
+        res.executable = target;
+    } else {
+        throw std::invalid_argument("Unknown command " + command);
+    }
+
+    for (std::string init; in >> init;) {
+        res.pre.emplace_back(init);
+    }
+
+    return res;
+}
+
+static std::string read_request(int fd) {
+    std::string res;
+
+    char ch;
+    while (res.size() < max_request_size) {
+        ssize_t count = read(fd, &ch, 1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            throw std::runtime_error("Incomplete request");
+        }
+
+        if (ch == '\n') {
+            return res;
+        }
+
+        res += ch;
+    }
+
+    throw std::runtime_error("Request too long");
+}
+
+static void write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t count = write(fd, data.data(), data.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            /* Client went away, nothing left to do */
+            return;
+        }
+
+        data.remove_prefix(count);
+    }
+}
+
+static std::string format_reply(const run_result& res, uint64_t wall_ns, const std::string& output) {
+    std::ostringstream out;
+
+    out << "status " << res.status << "\n"
+        << "exit " << (res.exit_type == ExitTypes::ExitByMarker ? "marker" : "status") << "\n"
+        << "elapsed_ns " << res.elapsed_ns << "\n"
+        << "wall_ns " << wall_ns << "\n"
+        << "mismatches " << res.mismatches << "\n"
+        << "mmio_traps " << res.mmio_traps << "\n"
+        << "raw_ns " << res.raw_ns << "\n"
+        << "handler_ns " << res.handler_ns << "\n"
+        << "pure_ns " << res.pure_ns << "\n";
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (res.perf[i].valid) {
+            out << "perf " << perf_event_names[i] << " " << res.perf[i].guest << " " << res.perf[i].handler << "\n";
+        }
+    }
+
+    char buf[32];
+    for (size_t i = 0; i < NUM_REGS; ++i) {
+        snprintf(buf, sizeof(buf), "0x%.16" PRIx64, res.regs[i]);
+        out << "reg " << i << " " << buf << "\n";
+    }
+
+    out << "output " << output.size() << "\n" << output;
+
+    return out.str();
+}
+
+/* Runs in the forked worker, never returns */
+[[noreturn]] static void serve(int conn, const elf_file& elf, const request& req, daemon_fn& fn,
+                               std::chrono::steady_clock::time_point begin) {
+    int output_fd = memfd_create("rv64-ume-output", MFD_CLOEXEC);
+    if (output_fd >= 0) {
+        dup2(output_fd, STDOUT_FILENO);
+        dup2(output_fd, STDERR_FILENO);
+    }
+
+    std::string reply;
+    try {
+        run_result res = fn(elf, req.pre, req.post);
+        std::cout.flush();
+
+        uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count();
+
+        reply = format_reply(res, wall_ns, output_fd >= 0 ? read_fd(output_fd) : std::string { });
+    } catch (std::exception& e) {
+        reply = std::string("error ") + e.what() + "\n";
+    }
+
+    write_all(conn, reply);
+    _exit(ExitCodes::Success);
+}
+
+int run_daemon(const std::string& socket_path, daemon_fn fn) {
+    sockaddr_un addr { };
+    addr.sun_family = AF_UNIX;
+
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument("Socket path too long");
+    }
+
+    std::copy(socket_path.begin(), socket_path.end(), addr.sun_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+    }
+
+    /* Remove a stale socket from a previous instance, but nothing else that happens to be there */
+    struct stat existing;
+    if (lstat(socket_path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            close(listen_fd);
+            throw std::runtime_error(socket_path + " exists and is not a socket");
+        }
+
+        unlink(socket_path.c_str());
+    }
+
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+        close(listen_fd);
+        throw std::runtime_error(std::string("Binding ") + socket_path + " failed: " + strerror(errno));
+    }
+
+    /* Workers reap themselves */
+    struct sigaction sig { };
+    sig.sa_handler = SIG_DFL;
+    sig.sa_flags = SA_NOCLDWAIT;
+    sigemptyset(&sig.sa_mask);
+    sigaction(SIGCHLD, &sig, nullptr);
+
+    /* Warm up anything the workers would otherwise redo every time */
+    timer_frequency();
+
+    std::cerr << "Listening on " << socket_path << std::endl;
+
+    std::map<std::string, cached_image> images;
+    uint64_t requests = 0;
+
+    for (;;) {
+        int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            close(listen_fd);
+            throw std::runtime_error(std::string("accept failed: ") + strerror(errno));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        ++requests;
+
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &request_timeout, sizeof(request_timeout));
+
+        try {
+            request req = parse_request(read_request(conn));
+            const elf_file& elf = get_image(images, req.executable, requests);
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+            }
+
+            if (pid == 0) {
+                close(listen_fd);
+                serve(conn, elf, req, fn, begin);
+            }
+        } catch (std::exception& e) {
+            write_all(conn, std::string("error ") + e.what() + "\n");
+        }
+
+        close(conn);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "elf_file.h"
+#include "util.h"
+
+/* Runs a single request in a forked worker, elf is already mapped */
+using daemon_fn = std::function<run_result(const elf_file& elf, std::vector<reg_init> pre,
+                                           const std::vector<reg_init>& post)>;
+
+/**
+ * Serve run requests on a Unix socket until killed. One request per connection, a single line:
+ *   run <executable> [reginit...]
+ *   test <testfile> [reginit...]
+ * The reply has one "key value" pair per line, ending in the guest's output. With -e
+ * there is a "perf <event> <guest> <handler>" line per available counter
+ */
+int run_daemon(const std::string& socket_path, daemon_fn fn);
+
+#endif /* DAEMON_H */
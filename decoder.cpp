@@ -0,0 +1,206 @@
+#include "decoder.h"
+
+/* Where an instruction keeps the register that is loaded into or stored from */
+enum class RegField : uint8_t {
+    Rd,     /* 11:7 */
+    Rs2,    /* 24:20 */
+    CPrime, /* 4:2, x8-x15, rd' and rs2' of c.lw and c.sw */
+    CRd,    /* 11:7, c.lwsp */
+    CRs2,   /* 6:2, c.swsp */
+};
+
+struct decode_entry {
+    AccessKind kind;
+    uint8_t width;
+    bool is_signed;
+    bool is_fp;
+    RegField field;
+};
+
+/* Compressed entries are indexed by quadrant and funct3, uncompressed by opcode[6:2] and funct3 */
+static constexpr size_t compressed_entries = 4 * 8;
+static constexpr size_t table_size = compressed_entries + 32 * 8;
+
+static constexpr size_t table_index(uint32_t instr) {
+    if ((instr & 0b11) != 0b11) {
+        return ((instr & 0b11) << 3) | ((instr >> 13) & 0b111);
+    }
+
+    return compressed_entries + ((((instr >> 2) & 0b11111) << 3) | ((instr >> 12) & 0b111));
+}
+
+static constexpr std::array<decode_entry, table_size> make_decode_table() {
+    std::array<decode_entry, table_size> table{};
+
+    auto compressed = [&table](uint8_t quadrant, uint8_t funct3, decode_entry entry) {
+        table[(quadrant << 3) | funct3] = entry;
+    };
+
+    auto regular = [&table](uint8_t opcode, uint8_t funct3, decode_entry entry) {
+        table[compressed_entries + ((((opcode >> 2) & 0b11111) << 3) | funct3)] = entry;
+    };
+
+    using enum AccessKind;
+    using enum RegField;
+
+    /* lb, lh, lw, ld, lbu, lhu, lwu */
+    for (uint8_t funct3 = 0; funct3 < 7; ++funct3) {
+        regular(0b0000011, funct3, { Load, static_cast<uint8_t>(1 << (funct3 & 0b11)), funct3 < 4, false, Rd });
+    }
+
+    /* sb, sh, sw, sd */
+    for (uint8_t funct3 = 0; funct3 < 4; ++funct3) {
+        regular(0b0100011, funct3, { Store, static_cast<uint8_t>(1 << funct3), false, false, Rs2 });
+    }
+
+    /* flw, fld, fsw, fsd */
+    regular(0b0000111, 0b010, { Load,  4, false, true, Rd  });
+    regular(0b0000111, 0b011, { Load,  8, false, true, Rd  });
+    regular(0b0100111, 0b010, { Store, 4, false, true, Rs2 });
+    regular(0b0100111, 0b011, { Store, 8, false, true, Rs2 });
+
+    /* AMO*.W and AMO*.D, funct5 is checked when decoding */
+    regular(0b0101111, 0b010, { Amo, 4, true, false, Rd });
+    regular(0b0101111, 0b011, { Amo, 8, true, false, Rd });
+
+    /* c.fld, c.lw, c.ld, c.fsd, c.sw, c.sd */
+    compressed(0b00, 0b001, { Load,  8, false, true,  CPrime });
+    compressed(0b00, 0b010, { Load,  4, true,  false, CPrime });
+    compressed(0b00, 0b011, { Load,  8, true,  false, CPrime });
+    compressed(0b00, 0b101, { Store, 8, false, true,  CPrime });
+    compressed(0b00, 0b110, { Store, 4, false, false, CPrime });
+    compressed(0b00, 0b111, { Store, 8, false, false, CPrime });
+
+    /* c.fldsp, c.lwsp, c.ldsp, c.fsdsp, c.swsp, c.sdsp */
+    compressed(0b10, 0b001, { Load,  8, false, true,  CRd  });
+    compressed(0b10, 0b010, { Load,  4, true,  false, CRd  });
+    compressed(0b10, 0b011, { Load,  8, true,  false, CRd  });
+    compressed(0b10, 0b101, { Store, 8, false, true,  CRs2 });
+    compressed(0b10, 0b110, { Store, 4, false, false, CRs2 });
+    compressed(0b10, 0b111, { Store, 8, false, false, CRs2 });
+
+    return table;
+}
+
+static constexpr std::array<decode_entry, table_size> decode_table = make_decode_table();
+
+static constexpr bool valid_amo(uint8_t op) {
+    switch (op) {
+        case AmoAdd: case AmoSwap: case AmoLr: case AmoSc: case AmoXor: case AmoOr:
+        case AmoAnd: case AmoMin: case AmoMax: case AmoMinu: case AmoMaxu:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static constexpr mmio_access decode(uint32_t instr) {
+    const decode_entry& entry = decode_table[table_index(instr)];
+
+    mmio_access res { };
+    res.kind = entry.kind;
+    res.width = entry.width;
+    res.is_signed = entry.is_signed;
+    res.is_fp = entry.is_fp;
+    res.length = ((instr & 0b11) == 0b11) ? 4 : 2;
+
+    switch (entry.field) {
+        case RegField::Rd:     res.reg = (instr >> 7) & 0b11111;      break;
+        case RegField::Rs2:    res.reg = (instr >> 20) & 0b11111;     break;
+        case RegField::CPrime: res.reg = 8 + ((instr >> 2) & 0b111);  break;
+        case RegField::CRd:    res.reg = (instr >> 7) & 0b11111;      break;
+        case RegField::CRs2:   res.reg = (instr >> 2) & 0b11111;      break;
+    }
+
+    if (res.kind == AccessKind::Amo) {
+        res.amo_op = instr >> 27;
+        res.amo_src = (instr >> 20) & 0b11111;
+
+        if (res.amo_op == AmoLr) {
+            res.kind = AccessKind::Load;
+        } else if (!valid_amo(res.amo_op)) {
+            res.kind = AccessKind::Invalid;
+        }
+    }
+
+    return res;
+}
+
+/* lw a0, 0(a0) and lbu a1, 0(a0) */
+static_assert(decode(0x00052503).kind == AccessKind::Load && decode(0x00052503).width == 4);
+static_assert(decode(0x00052503).reg == 10 && decode(0x00052503).is_signed && decode(0x00052503).length == 4);
+static_assert(decode(0x00054583).reg == 11 && decode(0x00054583).width == 1 && !decode(0x00054583).is_signed);
+
+/* sb a1, 0(a0) */
+static_assert(decode(0x00b50023).kind == AccessKind::Store && decode(0x00b50023).width == 1);
+static_assert(decode(0x00b50023).reg == 11 && !decode(0x00b50023).is_fp);
+
+/* fsd fa0, 8(a0) */
+static_assert(decode(0x00a53427).kind == AccessKind::Store && decode(0x00a53427).width == 8);
+static_assert(decode(0x00a53427).reg == 10 && decode(0x00a53427).is_fp);
+
+/* c.lw a0, 0(a0) and c.ldsp ra, 8(sp) */
+static_assert(decode(0x4108).kind == AccessKind::Load && decode(0x4108).reg == 10 && decode(0x4108).length == 2);
+static_assert(decode(0x60a2).kind == AccessKind::Load && decode(0x60a2).reg == 1 && decode(0x60a2).width == 8);
+
+/* c.swsp a0, 0(sp) and c.sdsp ra, 8(sp) */
+static_assert(decode(0xc02a).kind == AccessKind::Store && decode(0xc02a).reg == 10 && decode(0xc02a).width == 4);
+static_assert(decode(0xe406).kind == AccessKind::Store && decode(0xe406).reg == 1 && decode(0xe406).width == 8);
+
+/* amoswap.w a0, a1, (a2) */
+static_assert(decode(0x08b6252f).kind == AccessKind::Amo && decode(0x08b6252f).amo_op == AmoSwap);
+static_assert(decode(0x08b6252f).reg == 10 && decode(0x08b6252f).amo_src == 11 && decode(0x08b6252f).width == 4);
+
+/* addi a0, a0, 1 and c.addi a0, 1 */
+static_assert(decode(0x00150513).kind == AccessKind::Invalid);
+static_assert(decode(0x0505).kind == AccessKind::Invalid);
+
+mmio_access decode_instruction(uint32_t instr) {
+    return decode(instr);
+}
+
+static constexpr size_t cache_index(uintptr_t pc, size_t entries) {
+    /* Instructions are at least 2-byte aligned */
+    return (pc >> 1) & (entries - 1);
+}
+
+void DecodeCache::set_enabled(bool enabled) {
+    _enabled = enabled;
+}
+
+mmio_access* DecodeCache::lookup(uintptr_t pc) {
+    entry& e = _entries[cache_index(pc, num_entries)];
+
+    if (_enabled && e.pc == pc) {
+        ++_hits;
+        return &e.access;
+    }
+
+    ++_misses;
+    return nullptr;
+}
+
+mmio_access* DecodeCache::insert(uintptr_t pc, const mmio_access& access) {
+    entry& e = _entries[cache_index(pc, num_entries)];
+
+    /* Still store when disabled, the caller gets a pointer to work with either way */
+    e.pc = _enabled ? pc : 0;
+    e.access = access;
+
+    return &e.access;
+}
+
+void DecodeCache::reset() {
+    _entries.fill(entry { });
+    _hits = 0;
+    _misses = 0;
+}
+
+uint64_t DecodeCache::hits() const {
+    return _hits;
+}
+
+uint64_t DecodeCache::misses() const {
+    return _misses;
+}
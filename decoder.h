@@ -0,0 +1,109 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <array>
+
+#include <cstddef>
+#include <cstdint>
+
+enum class Device : uint8_t {
+    Unknown = 0,
+    Start,
+    Exit,
+    Serial,
+    Framebuffer,
+    Calibrate,
+    BulkIO,
+    Disk,
+    Checkpoint,
+};
+
+enum class AccessKind : uint8_t {
+    Invalid = 0,
+    Load,
+    Store,
+    /* Read-modify-write, including sc but not lr (which is a Load) */
+    Amo,
+};
+
+/* funct5 of the AMO instructions */
+enum AmoOps : uint8_t {
+    AmoAdd  = 0b00000,
+    AmoSwap = 0b00001,
+    AmoLr   = 0b00010,
+    AmoSc   = 0b00011,
+    AmoXor  = 0b00100,
+    AmoOr   = 0b01000,
+    AmoAnd  = 0b01100,
+    AmoMin  = 0b10000,
+    AmoMax  = 0b10100,
+    AmoMinu = 0b11000,
+    AmoMaxu = 0b11100,
+};
+
+/* A load or store to MMIO, as decoded from the faulting instruction */
+struct mmio_access {
+    AccessKind kind;
+    uint8_t width;
+
+    /* Loaded values are sign-extended, otherwise zero-extended (or NaN-boxed for FP) */
+    bool is_signed;
+
+    /* reg is an FP register */
+    bool is_fp;
+
+    /* Source register for stores, destination for loads and AMOs */
+    uint8_t reg;
+
+    /* Source register and funct5 of an AMO */
+    uint8_t amo_src;
+    uint8_t amo_op;
+
+    /* Instruction length, for skipping it */
+    uint8_t length;
+
+    /* Device the access was resolved to, for the address it was resolved for */
+    Device device;
+    uintptr_t addr;
+};
+
+/**
+ * Decode any RV64GC load, store or AMO. instr holds the instruction's bits, only the
+ * lower 16 are looked at for compressed instructions. Result has kind Invalid if
+ * it's not a memory access. Host-independent, see the static_asserts in decoder.cpp
+ */
+mmio_access decode_instruction(uint32_t instr);
+
+/* Direct-mapped cache of decoded accesses by PC, only used from the signal handler */
+class DecodeCache {
+    static constexpr size_t num_entries = 256;
+
+    struct entry {
+        uintptr_t pc;
+        mmio_access access;
+    };
+
+    std::array<entry, num_entries> _entries{};
+
+    bool _enabled = true;
+
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+
+    public:
+    void set_enabled(bool enabled);
+
+    /* Cached access for pc, nullptr on a miss */
+    mmio_access* lookup(uintptr_t pc);
+
+    /* Store a freshly decoded access, returns the stored copy */
+    mmio_access* insert(uintptr_t pc, const mmio_access& access);
+
+    /* Forget everything between runs, another executable may have other code at the same PCs */
+    void reset();
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+};
+
+#endif /* DECODER_H */
@@ -0,0 +1,232 @@
+#include "dirty_tracker.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+/* See Documentation/admin-guide/mm/soft-dirty.rst */
+static constexpr uint64_t pagemap_soft_dirty = uint64_t { 1 } << 55;
+
+#if defined(PAGEMAP_SCAN) && defined(UFFD_FEATURE_WP_ASYNC)
+# define HAVE_PAGEMAP_SCAN
+#endif
+
+static bool read_soft_dirty(int pagemap, uintptr_t begin, size_t pages, std::vector<uint64_t>& entries,
+                            std::vector<uint8_t>& dirty) {
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    entries.resize(pages);
+    dirty.assign(pages, 0);
+
+    size_t bytes = pages * sizeof(uint64_t);
+    off_t offset = (begin / page_size) * sizeof(uint64_t);
+
+    for (size_t done = 0; done < bytes;) {
+        ssize_t count = pread(pagemap, reinterpret_cast<char*>(entries.data()) + done, bytes - done, offset + done);
+        if (count <= 0) {
+            return false;
+        }
+
+        done += count;
+    }
+
+    for (size_t i = 0; i < pages; ++i) {
+        dirty[i] = (entries[i] & pagemap_soft_dirty) != 0;
+    }
+
+    return true;
+}
+
+DirtyTracker::DirtyTracker(uintptr_t begin, size_t pages) : _begin { begin }, _pages { pages } {
+    _pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (_pagemap < 0) {
+        return;
+    }
+
+    if (_init_write_protect()) {
+        _method = Method::WriteProtect;
+    } else if (_init_soft_dirty()) {
+        _method = Method::SoftDirty;
+    }
+}
+
+DirtyTracker::~DirtyTracker() {
+    /* Closing the userfaultfd unregisters the range and drops the protection */
+    if (_uffd >= 0) close(_uffd);
+    if (_pagemap >= 0) close(_pagemap);
+    if (_clear_refs >= 0) close(_clear_refs);
+}
+
+bool DirtyTracker::supported() const {
+    return _method != Method::None;
+}
+
+bool DirtyTracker::atomic() const {
+    return _method == Method::WriteProtect;
+}
+
+bool DirtyTracker::scan(std::vector<uint8_t>& dirty) {
+    switch (_method) {
+        case Method::SoftDirty:
+            return read_soft_dirty(_pagemap, _begin, _pages, _entries, dirty);
+
+#ifdef HAVE_PAGEMAP_SCAN
+        case Method::WriteProtect: {
+            static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+            dirty.assign(_pages, 0);
+
+            /* Written pages come back as regions and are protected again in the same walk */
+            uintptr_t end = _begin + _pages * page_size;
+            for (uintptr_t start = _begin; start < end;) {
+                pm_scan_arg arg { };
+                arg.size = sizeof(arg);
+                arg.flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC;
+                arg.start = start;
+                arg.end = end;
+                arg.vec = reinterpret_cast<uintptr_t>(_entries.data());
+                arg.vec_len = _entries.size() * sizeof(uint64_t) / sizeof(page_region);
+                arg.category_mask = PAGE_IS_WRITTEN;
+                arg.return_mask = PAGE_IS_WRITTEN;
+
+                int regions = ioctl(_pagemap, PAGEMAP_SCAN, &arg);
+                if (regions < 0) {
+                    return false;
+                }
+
+                const page_region* found = reinterpret_cast<const page_region*>(_entries.data());
+                for (int i = 0; i < regions; ++i) {
+                    for (uintptr_t page = found[i].start; page < found[i].end; page += page_size) {
+                        dirty[(page - _begin) / page_size] = 1;
+                    }
+                }
+
+                /* Stops early once the vector is full */
+                if (arg.walk_end <= start) {
+                    return false;
+                }
+
+                start = arg.walk_end;
+            }
+
+            return true;
+        }
+#endif
+
+        default:
+            return false;
+    }
+}
+
+void DirtyTracker::reset() {
+    switch (_method) {
+        case Method::SoftDirty:
+            /* 4 clears the soft-dirty bits */
+            if (pwrite(_clear_refs, "4", 1, 0) != 1) {
+                _method = Method::None;
+            }
+            break;
+
+#ifdef HAVE_PAGEMAP_SCAN
+        case Method::WriteProtect: {
+            static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+            uffdio_writeprotect wp { };
+            wp.range.start = _begin;
+            wp.range.len = _pages * page_size;
+            wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+
+            if (ioctl(_uffd, UFFDIO_WRITEPROTECT, &wp) != 0) {
+                _method = Method::None;
+            }
+            break;
+        }
+#endif
+
+        default:
+            break;
+    }
+}
+
+bool DirtyTracker::_init_write_protect() {
+#ifdef HAVE_PAGEMAP_SCAN
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (_pages == 0) {
+        return false;
+    }
+
+    /* User mode only needs no privileges, async faults never reach us either way */
+    _uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (_uffd < 0) {
+        return false;
+    }
+
+    uffdio_api api { };
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED | UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+
+    uffdio_register reg { };
+    reg.range.start = _begin;
+    reg.range.len = _pages * page_size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(_uffd, UFFDIO_API, &api) != 0 || ioctl(_uffd, UFFDIO_REGISTER, &reg) != 0) {
+        close(_uffd);
+        _uffd = -1;
+        return false;
+    }
+
+    /* At most every other page is a separate region */
+    _entries.resize((_pages / 2 + 1) * sizeof(page_region) / sizeof(uint64_t));
+
+    _method = Method::WriteProtect;
+    reset();
+
+    std::vector<uint8_t> dirty;
+    if (_method != Method::WriteProtect || !scan(dirty)) {
+        close(_uffd);
+        _uffd = -1;
+        _method = Method::None;
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool DirtyTracker::_init_soft_dirty() {
+    _clear_refs = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (_clear_refs < 0) {
+        return false;
+    }
+
+    /* Reading the bit works regardless, so check that a write actually sets it */
+    long page_size = sysconf(_SC_PAGESIZE);
+    void* probe = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (probe == MAP_FAILED) {
+        return false;
+    }
+
+    _method = Method::SoftDirty;
+
+    *static_cast<volatile char*>(probe) = 1;
+    reset();
+    *static_cast<volatile char*>(probe) = 2;
+
+    std::vector<uint8_t> dirty;
+    bool works = _method == Method::SoftDirty
+        && read_soft_dirty(_pagemap, reinterpret_cast<uintptr_t>(probe), 1, _entries, dirty) && dirty[0];
+
+    munmap(probe, page_size);
+
+    _method = Method::None;
+    return works;
+}
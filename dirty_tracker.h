@@ -0,0 +1,58 @@
+#ifndef DIRTY_TRACKER_H
+#define DIRTY_TRACKER_H
+
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Finds pages of a range written since the last scan or reset. Where the kernel has
+ * PAGEMAP_SCAN (6.7+), the range is write-protected through userfaultfd in async mode,
+ * and a scan reports the written pages and protects them again in one step, leaving
+ * the rest of the process alone. Otherwise it falls back to soft-dirty bits, which can
+ * only be cleared for the whole process and not atomically with the scan.
+ */
+class DirtyTracker {
+    enum class Method : uint8_t {
+        None,
+        WriteProtect,
+        SoftDirty,
+    };
+
+    uintptr_t _begin;
+    size_t _pages;
+
+    Method _method = Method::None;
+
+    int _pagemap = -1;
+    int _clear_refs = -1;
+    int _uffd = -1;
+
+    /* Pagemap entries for soft-dirty, page regions for PAGEMAP_SCAN */
+    std::vector<uint64_t> _entries;
+
+    public:
+    DirtyTracker(uintptr_t begin, size_t pages);
+    ~DirtyTracker();
+
+    DirtyTracker(const DirtyTracker&) = delete;
+    DirtyTracker& operator=(const DirtyTracker&) = delete;
+
+    /* False if neither method works, i.e. no CONFIG_MEM_SOFT_DIRTY or /proc isn't usable */
+    bool supported() const;
+
+    /* Whether scan() also resets, so writes can't slip in between the two */
+    bool atomic() const;
+
+    /* Set dirty[i] for every page i of the range written since the last reset, false on failure */
+    bool scan(std::vector<uint8_t>& dirty);
+
+    void reset();
+
+    private:
+    bool _init_write_protect();
+    bool _init_soft_dirty();
+};
+
+#endif /* DIRTY_TRACKER_H */
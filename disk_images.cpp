@@ -0,0 +1,111 @@
+#include "disk_images.h"
+
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+DiskImages::~DiskImages() {
+    for (const disk_image& image : _images) {
+        close(image.fd);
+    }
+}
+
+void DiskImages::add(const std::string& spec) {
+    if (_images.size() == max_disk_images) {
+        throw std::runtime_error("Too many disk images, at most " + std::to_string(max_disk_images));
+    }
+
+    std::string path = spec;
+    uint64_t flags = 0;
+
+    if (spec.ends_with(":cow")) {
+        path = spec.substr(0, spec.size() - 4);
+        flags |= DiskWritable;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open disk image " + path + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Disk image " + path + " is not a non-empty regular file");
+    }
+
+    uintptr_t base = disk_base;
+    if (!_images.empty()) {
+        const disk_image& last = _images.back();
+        base = (last.base + last.size + disk_alignment - 1) & ~(disk_alignment - 1);
+    }
+
+    _images.push_back(disk_image { path, fd, base, static_cast<uint64_t>(st.st_size), flags });
+}
+
+size_t DiskImages::count() const {
+    return _images.size();
+}
+
+std::vector<safe_map> DiskImages::map() const {
+    std::vector<safe_map> res;
+
+    for (const disk_image& image : _images) {
+        int prot = PROT_READ | ((image.flags & DiskWritable) ? PROT_WRITE : 0);
+        void* target = reinterpret_cast<void*>(image.base);
+
+        void* map = mmap(target, image.size, prot, MAP_PRIVATE | MAP_FIXED_NOREPLACE, image.fd, 0);
+        if (map != target) {
+            if (map != MAP_FAILED) {
+                munmap(map, image.size);
+            }
+
+            throw std::runtime_error("Mapping disk image " + image.path + " failed: "
+                    + strerrorname_np(errno) + " - " + strerror(errno));
+        }
+
+        res.emplace_back(map, image.size, prot);
+    }
+
+    return res;
+}
+
+bool DiskImages::handle_read(uintptr_t addr, uint8_t size, uint64_t& val) const {
+    if (!owns(addr) || size != 8 || (addr & 7)) {
+        return false;
+    }
+
+    if (addr == disk_count_reg) {
+        val = _images.size();
+        return true;
+    }
+
+    if (addr < disk_entries_addr) {
+        val = 0;
+        return true;
+    }
+
+    size_t idx = (addr - disk_entries_addr) / disk_entry_size;
+    size_t field = (addr - disk_entries_addr) % disk_entry_size / 8;
+
+    if (idx >= _images.size()) {
+        val = 0;
+        return true;
+    }
+
+    const disk_image& image = _images[idx];
+    switch (field) {
+        case 0:  val = image.base; break;
+        case 1:  val = image.size; break;
+        case 2:  val = image.flags; break;
+        default: val = 0; break;
+    }
+
+    return true;
+}
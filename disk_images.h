@@ -0,0 +1,68 @@
+#ifndef DISK_IMAGES_H
+#define DISK_IMAGES_H
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "elf_file.h"
+
+/**
+ * Host files mapped straight into the guest, so it can read them without copies or traps.
+ * Images are placed one after another from disk_base, each 2 MiB aligned. Read-only
+ * descriptor registers, all 8 bytes wide:
+ * - 0x300 DISK_COUNT: number of images
+ * - 0x320 + i * 0x20: base address, size in bytes and flags (DiskFlags) of image i
+ */
+static constexpr uintptr_t disk_regs_addr = 0x300;
+static constexpr uintptr_t disk_count_reg = disk_regs_addr;
+static constexpr uintptr_t disk_entries_addr = disk_regs_addr + 0x20;
+static constexpr uintptr_t disk_entry_size = 0x20;
+static constexpr size_t max_disk_images = 8;
+static constexpr uintptr_t disk_regs_end = disk_entries_addr + max_disk_images * disk_entry_size;
+
+static constexpr uintptr_t disk_base = 0x40000000;
+static constexpr uintptr_t disk_alignment = 2 * 1024 * 1024;
+
+enum DiskFlags : uint64_t {
+    /* Writes go to private copy-on-write pages and are dropped at exit */
+    DiskWritable = 1 << 0,
+};
+
+class DiskImages {
+    struct disk_image {
+        std::string path;
+        int fd;
+        uintptr_t base;
+        uint64_t size;
+        uint64_t flags;
+    };
+
+    std::vector<disk_image> _images;
+
+    public:
+    DiskImages() = default;
+    ~DiskImages();
+
+    DiskImages(const DiskImages&) = delete;
+    DiskImages& operator=(const DiskImages&) = delete;
+
+    static bool owns(uintptr_t addr) {
+        return addr >= disk_regs_addr && addr < disk_regs_end;
+    }
+
+    /* "path" for a read-only image, "path:cow" for a copy-on-write one */
+    void add(const std::string& spec);
+
+    size_t count() const;
+
+    /* Fresh mappings of every image, so copy-on-write changes don't carry over between runs */
+    std::vector<safe_map> map() const;
+
+    /* Return true if handled, signal-safe */
+    bool handle_read(uintptr_t addr, uint8_t size, uint64_t& val) const;
+};
+
+#endif /* DISK_IMAGES_H */
@@ -1,5 +1,6 @@
 #include "elf_file.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <stdexcept>
@@ -31,6 +32,7 @@ safe_map::safe_map(const char* path) {
     }
 
     _size = st.st_size;
+    _prot = PROT_READ;
     _map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
     if (_map == MAP_FAILED) {
         close(_fd);
@@ -38,11 +40,14 @@ safe_map::safe_map(const char* path) {
     }
 }
 
-safe_map::safe_map(void* map, uint64_t size) : _map { map }, _size { size } {
+safe_map::safe_map(void* map, uint64_t size, int prot, int fd)
+    : _fd { fd }, _map { map }, _size { size }, _prot { prot } {
 
 }
 
-safe_map::safe_map(safe_map&& other) noexcept : _map { other._map }, _size { other._size } {
+safe_map::safe_map(safe_map&& other) noexcept
+    : _fd { other._fd }, _map { other._map }, _size { other._size }, _prot { other._prot } {
+    other._fd = 0;
     other._map = nullptr;
     other._size = 0;
 }
@@ -50,8 +55,10 @@ safe_map::safe_map(safe_map&& other) noexcept : _map { other._map }, _size { oth
 safe_map& safe_map::operator=(safe_map&& other) noexcept {
     _unload();
 
+    _fd = std::exchange(other._fd, 0);
     _map = std::exchange(other._map, nullptr);
     _size = std::exchange(other._size, 0);
+    _prot = std::exchange(other._prot, 0);
 
     return *this;
 }
@@ -65,6 +72,14 @@ void* safe_map::map(uint64_t off) const {
     return static_cast<char*>(_map) + off;
 }
 
+uint64_t safe_map::size() const {
+    return _size;
+}
+
+int safe_map::prot() const {
+    return _prot;
+}
+
 int safe_map::fd() const {
     return _fd;
 }
@@ -79,8 +94,43 @@ void safe_map::_unload() {
     }
 }
 
-elf_file::elf_file(const std::string& path) : _map { path.c_str() } {
-    _load_programs();
+elf_file::elf_file(const std::string& path, bool load) : _path { path }, _map { path.c_str() } {
+    _validate();
+    _load_symbols();
+    _load_sections();
+
+    if (load) {
+        this->load();
+    }
+}
+
+void elf_file::load() {
+    if (_loaded) {
+        return;
+    }
+
+    try {
+        _load_programs();
+    } catch (...) {
+        /* Don't leave the programs that did fit behind */
+        _programs.clear();
+        throw;
+    }
+
+    _loaded = true;
+}
+
+void elf_file::unload() {
+    _programs.clear();
+    _loaded = false;
+}
+
+bool elf_file::loaded() const {
+    return _loaded;
+}
+
+const std::string& elf_file::path() const {
+    return _path;
 }
 
 std::span<const safe_map> elf_file::programs() const {
@@ -93,7 +143,50 @@ uintptr_t elf_file::entry() const {
     return elf->e_entry;
 }
 
-void elf_file::_load_programs() {
+std::span<const elf_symbol> elf_file::symbols() const {
+    return _symbols;
+}
+
+std::span<const elf_section> elf_file::code_sections() const {
+    return _code_sections;
+}
+
+const elf_symbol* elf_file::find_symbol(uintptr_t addr) const {
+    auto it = std::upper_bound(_symbols.begin(), _symbols.end(), addr,
+                               [](uintptr_t addr, const elf_symbol& sym) { return addr < sym.addr; });
+
+    if (it == _symbols.begin()) {
+        return nullptr;
+    }
+
+    --it;
+
+    /* Assembly labels usually have no size, assume they extend up to the next symbol */
+    if (it->size > 0 && addr >= it->addr + it->size) {
+        return nullptr;
+    }
+
+    return &*it;
+}
+
+std::string elf_file::symbolize(uintptr_t addr) const {
+    char buf[32];
+
+    const elf_symbol* sym = find_symbol(addr);
+    if (!sym) {
+        snprintf(buf, sizeof(buf), "0x%lx", addr);
+        return buf;
+    }
+
+    if (addr == sym->addr) {
+        return sym->name;
+    }
+
+    snprintf(buf, sizeof(buf), "+0x%lx", addr - sym->addr);
+    return sym->name + buf;
+}
+
+void elf_file::_validate() const {
     const Elf64_Ehdr* elf = static_cast<Elf64_Ehdr*>(_map.map());
 
     if (memcmp(elf->e_ident, ELFMAG, SELFMAG) != 0) {
@@ -127,6 +220,10 @@ void elf_file::_load_programs() {
     if (elf->e_phoff == 0) {
         throw std::runtime_error("No programs present");
     }
+}
+
+void elf_file::_load_programs() {
+    const Elf64_Ehdr* elf = static_cast<Elf64_Ehdr*>(_map.map());
 
     std::span<const Elf64_Phdr> programs = std::span(
         static_cast<Elf64_Phdr*>(_map.map(elf->e_phoff)), elf->e_phnum);
@@ -151,22 +248,7 @@ void elf_file::_load_programs() {
             void* target_ptr = reinterpret_cast<void*>(target_addr);
 
             if (prot & PROT_WRITE) {
-                /* MAP_ANONYMOUS and memcpy existing (possibly partial) data */
-                void* map = mmap(target_ptr, p.p_memsz + addr_offset,
-                                 prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
-                                 -1, 0);
-
-                if (map != target_ptr) {
-                    if (map != MAP_FAILED) {
-                        munmap(map, p.p_filesz);
-                    }
-                    
-                    throw std::runtime_error(std::string("Mapping failed: ")
-                            + strerrorname_np(errno) + " - " + strerror(errno));
-                }
-
-                memcpy(reinterpret_cast<char*>(map) + addr_offset, _map.map(p.p_offset), p.p_filesz);
-                _programs.emplace_back(map, p.p_memsz);
+                _map_writable(p, target_addr, addr_offset, prot, page_size);
             } else {
                 if (p.p_memsz != p.p_filesz) {
                     throw std::runtime_error("filesz != memsz on non-writable page");
@@ -190,8 +272,137 @@ void elf_file::_load_programs() {
                             + strerrorname_np(errno) + " - " + strerror(errno));
                 }
 
-                _programs.emplace_back(map, p.p_memsz);
+                _programs.emplace_back(map, p.p_memsz, prot);
             }
         }
     }
 }
+
+void elf_file::_map_writable(const Elf64_Phdr& p, uintptr_t target_addr, uintptr_t addr_offset,
+                             int prot, uintptr_t page_size) {
+    void* target_ptr = reinterpret_cast<void*>(target_addr);
+    uint64_t size = p.p_memsz + addr_offset;
+
+    /* Reserve the whole segment first, what the file doesn't cover stays as zeroed .bss */
+    void* map = mmap(target_ptr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (map != target_ptr) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+
+        throw std::runtime_error(std::string("Mapping failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    _programs.emplace_back(map, size, prot);
+
+    if (p.p_filesz == 0) {
+        return;
+    }
+
+    char* data = static_cast<char*>(map) + addr_offset;
+
+    if ((p.p_offset & (page_size - 1)) != addr_offset) {
+        /* Offset and address disagree within the page so it can't be mapped, copy it instead */
+        memcpy(data, _map.map(p.p_offset), p.p_filesz);
+        return;
+    }
+
+    /* Map the initialized data copy-on-write so untouched pages are never read or copied */
+    uint64_t file_size = (addr_offset + p.p_filesz + page_size - 1) & ~(page_size - 1);
+
+    void* file_map = mmap(target_ptr, file_size, prot, MAP_PRIVATE | MAP_FIXED,
+                          _map.fd(), p.p_offset - addr_offset);
+
+    if (file_map != target_ptr) {
+        throw std::runtime_error(std::string("Mapping failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    /* The partial first and last pages pull in whatever surrounds the segment in the file */
+    memset(map, 0, addr_offset);
+
+    if (p.p_memsz > p.p_filesz) {
+        uint64_t file_end = addr_offset + p.p_filesz;
+        memset(static_cast<char*>(map) + file_end, 0, std::min<uint64_t>(file_size, size) - file_end);
+    }
+}
+
+void elf_file::_load_symbols() {
+    const Elf64_Ehdr* elf = static_cast<Elf64_Ehdr*>(_map.map());
+
+    /* Symbols are only used for reports, so silently go without on anything odd */
+    if (elf->e_shoff == 0 || elf->e_shentsize != sizeof(Elf64_Shdr)
+        || elf->e_shoff + elf->e_shnum * sizeof(Elf64_Shdr) > _map.size()) {
+        return;
+    }
+
+    std::span<const Elf64_Shdr> sections = std::span(
+        static_cast<Elf64_Shdr*>(_map.map(elf->e_shoff)), elf->e_shnum);
+
+    for (const Elf64_Shdr& section : sections) {
+        if (section.sh_type != SHT_SYMTAB || section.sh_entsize != sizeof(Elf64_Sym)
+            || section.sh_link >= sections.size()) {
+            continue;
+        }
+
+        const Elf64_Shdr& strtab = sections[section.sh_link];
+        if (section.sh_offset + section.sh_size > _map.size() || strtab.sh_offset + strtab.sh_size > _map.size()) {
+            continue;
+        }
+
+        std::span<const Elf64_Sym> syms = std::span(
+            static_cast<Elf64_Sym*>(_map.map(section.sh_offset)), section.sh_size / sizeof(Elf64_Sym));
+        const char* names = static_cast<const char*>(_map.map(strtab.sh_offset));
+
+        for (const Elf64_Sym& sym : syms) {
+            int type = ELF64_ST_TYPE(sym.st_info);
+            if ((type != STT_FUNC && type != STT_NOTYPE) || sym.st_shndx == SHN_UNDEF
+                || sym.st_shndx >= sections.size() || sym.st_name >= strtab.sh_size) {
+                continue;
+            }
+
+            /* Only code is interesting, this also drops the assembler's local labels for data */
+            if (!(sections[sym.st_shndx].sh_flags & SHF_EXECINSTR)) {
+                continue;
+            }
+
+            std::string_view name { names + sym.st_name, strnlen(names + sym.st_name, strtab.sh_size - sym.st_name) };
+
+            /* Mapping symbols ($x, $d) mark code/data regions, not functions */
+            if (name.empty() || name.front() == '$') {
+                continue;
+            }
+
+            _symbols.push_back(elf_symbol { sym.st_value, sym.st_size, std::string { name } });
+        }
+    }
+
+    std::sort(_symbols.begin(), _symbols.end(), [](const elf_symbol& a, const elf_symbol& b) {
+        return a.addr < b.addr;
+    });
+}
+
+void elf_file::_load_sections() {
+    const Elf64_Ehdr* elf = static_cast<Elf64_Ehdr*>(_map.map());
+
+    if (elf->e_shoff == 0 || elf->e_shentsize != sizeof(Elf64_Shdr)
+        || elf->e_shoff + elf->e_shnum * sizeof(Elf64_Shdr) > _map.size()) {
+        return;
+    }
+
+    std::span<const Elf64_Shdr> sections = std::span(
+        static_cast<Elf64_Shdr*>(_map.map(elf->e_shoff)), elf->e_shnum);
+
+    for (const Elf64_Shdr& section : sections) {
+        if (section.sh_type == SHT_PROGBITS && section.sh_size > 0
+            && (section.sh_flags & (SHF_ALLOC | SHF_EXECINSTR)) == (SHF_ALLOC | SHF_EXECINSTR)) {
+            _code_sections.push_back(elf_section { section.sh_addr, section.sh_size });
+        }
+    }
+
+    std::sort(_code_sections.begin(), _code_sections.end(), [](const elf_section& a, const elf_section& b) {
+        return a.addr < b.addr;
+    });
+}
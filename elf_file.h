@@ -11,10 +11,12 @@ class safe_map {
     int _fd = 0;
     void* _map = nullptr;
     uint64_t _size = 0;
+    int _prot = 0;
 
     public:
     safe_map(const char* path);
-    safe_map(void* map, uint64_t size);
+    /* Takes ownership of fd if given, i.e. the memfd backing the mapping */
+    safe_map(void* map, uint64_t size, int prot = 0, int fd = 0);
 
     safe_map(const safe_map&) = delete;
     safe_map& operator=(const safe_map&) = delete;
@@ -25,25 +27,72 @@ class safe_map {
     ~safe_map();
 
     void* map(uint64_t off = 0) const;
+    uint64_t size() const;
+    int prot() const;
     int fd() const;
 
     private:
     void _unload();
 };
 
+struct elf_symbol {
+    uintptr_t addr;
+    uint64_t size;
+    std::string name;
+};
+
+struct elf_section {
+    uintptr_t addr;
+    uint64_t size;
+};
+
 class elf_file {
+    std::string _path;
     safe_map _map;
 
     std::vector<safe_map> _programs;
 
+    /* Code symbols from .symtab sorted by address, empty if stripped */
+    std::vector<elf_symbol> _symbols;
+
+    /* Allocated executable sections sorted by address, empty without section headers */
+    std::vector<elf_section> _code_sections;
+
+    bool _loaded = false;
+
     public:
-    explicit elf_file(const std::string& path);
+    /* Without load, the file is only validated and can be mapped later */
+    explicit elf_file(const std::string& path, bool load = true);
 
+    /* Map the programs at their fixed addresses, throws if anything is in the way */
+    void load();
+    void unload();
+    bool loaded() const;
+
+    const std::string& path() const;
     std::span<const safe_map> programs() const;
     uintptr_t entry() const;
 
+    std::span<const elf_symbol> symbols() const;
+
+    /* Where the code is, segments also hold headers and read-only data such as .rodata and .eh_frame */
+    std::span<const elf_section> code_sections() const;
+
+    /* Symbol containing addr, or null */
+    const elf_symbol* find_symbol(uintptr_t addr) const;
+
+    /* "symbol+0xoffset", or just the address if there's no symbol for it */
+    std::string symbolize(uintptr_t addr) const;
+
     private:
+    void _validate() const;
     void _load_programs();
+    void _load_symbols();
+    void _load_sections();
+
+    /* Writable segments are mapped privately from the file, with .bss zero-filled behind them */
+    void _map_writable(const Elf64_Phdr& p, uintptr_t target_addr, uintptr_t addr_offset,
+                       int prot, uintptr_t page_size);
 };
 
 #endif /* ELF_FILE_H */
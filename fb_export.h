@@ -0,0 +1,78 @@
+#ifndef FB_EXPORT_H
+#define FB_EXPORT_H
+
+#include <algorithm>
+#include <atomic>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Layout of the memfd backing the framebuffer, so other processes can map it
+ * through /proc/<pid>/fd/<fd>. The header page comes first, the pixels start
+ * at fb_offset. Doesn't depend on anything else in the emulator so viewers can
+ * include it on its own.
+ */
+static constexpr uint32_t fb_export_magic = 0x42465652; /* "RVFB" */
+static constexpr uint32_t fb_export_version = 1;
+static constexpr size_t fb_export_header_size = 4096;
+
+struct fb_export_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fb_offset;
+    uint64_t fb_size;
+
+    /* Odd while control or palette are being written, readers retry on a change */
+    std::atomic_uint32_t seq;
+
+    /* Bumped every time the guest writes the present register */
+    std::atomic_uint32_t frame;
+
+    std::atomic_uint32_t enable;
+    std::atomic_uint32_t mode;
+    std::atomic_uint32_t resx;
+    std::atomic_uint32_t resy;
+    std::atomic_uint32_t palette[256];
+};
+
+static_assert(sizeof(fb_export_header) <= fb_export_header_size);
+static_assert(std::atomic_uint32_t::is_always_lock_free, "Needs to work across processes");
+
+/* Consistent copy of the control registers and palette, for viewers */
+struct fb_export_state {
+    uint32_t frame;
+    uint32_t enable;
+    uint32_t mode;
+    uint32_t resx;
+    uint32_t resy;
+    uint32_t palette[256];
+};
+
+static inline fb_export_state fb_export_read(const fb_export_header& hdr) {
+    fb_export_state res;
+
+    for (;;) {
+        uint32_t seq = hdr.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        res.frame = hdr.frame.load(std::memory_order_relaxed);
+        res.enable = hdr.enable.load(std::memory_order_relaxed);
+        res.mode = hdr.mode.load(std::memory_order_relaxed);
+        res.resx = hdr.resx.load(std::memory_order_relaxed);
+        res.resy = hdr.resy.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < std::size(res.palette); ++i) {
+            res.palette[i] = hdr.palette[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (hdr.seq.load(std::memory_order_relaxed) == seq) {
+            return res;
+        }
+    }
+}
+
+#endif /* FB_EXPORT_H */
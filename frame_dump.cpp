@@ -0,0 +1,72 @@
+#include "frame_dump.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+dump_options parse_dump_path(const std::string& path) {
+    dump_options res;
+    res.path = path;
+
+    if (path.ends_with(".ppm")) {
+        res.format = DumpFormat::PPM;
+    } else if (path.ends_with(".rgba") || path.ends_with(".raw")) {
+        res.format = DumpFormat::Raw;
+    } else {
+        throw std::invalid_argument("Unknown frame dump format " + path + ", expected .ppm, .rgba or .raw");
+    }
+
+    return res;
+}
+
+std::string dump_frame_path(const dump_options& opts, int64_t index) {
+    size_t dot = opts.path.rfind('.');
+    std::string stem = opts.path.substr(0, dot);
+    std::string ext = opts.path.substr(dot);
+
+    if (index < 0) {
+        return stem + "-final" + ext;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "-%06lld", static_cast<long long>(index));
+    return stem + buf + ext;
+}
+
+void write_frame(const std::string& path, DumpFormat format, std::span<const uint32_t> pixels,
+                 uint32_t width, uint32_t height) {
+    std::ofstream out { path, std::ios::binary | std::ios::trunc };
+    if (!out) {
+        throw std::runtime_error("Could not open " + path);
+    }
+
+    size_t channels = format == DumpFormat::PPM ? 3 : 4;
+
+    if (format == DumpFormat::PPM) {
+        out << "P6\n" << width << " " << height << "\n255\n";
+    }
+
+    /* Byte order is fixed regardless of host endianness */
+    std::vector<char> row(width * channels);
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t pixel = pixels[y * width + x];
+
+            char* dst = &row[x * channels];
+            dst[0] = pixel >> 24;
+            dst[1] = pixel >> 16;
+            dst[2] = pixel >> 8;
+
+            if (channels == 4) {
+                dst[3] = pixel;
+            }
+        }
+
+        out.write(row.data(), row.size());
+    }
+
+    if (!out) {
+        throw std::runtime_error("Writing " + path + " failed");
+    }
+}
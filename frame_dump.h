@@ -0,0 +1,40 @@
+#ifndef FRAME_DUMP_H
+#define FRAME_DUMP_H
+
+#include <span>
+#include <string>
+
+#include <cstdint>
+
+enum class DumpFormat {
+    PPM,    /* Binary P6, alpha dropped */
+    Raw     /* R, G, B, A bytes per pixel, no header */
+};
+
+/**
+ * Where and how often the headless framebuffer writes frames. Files are named
+ * <stem>-<n><ext> with the last frame at exit written to <stem>-final<ext>.
+ */
+struct dump_options {
+    std::string path;
+    DumpFormat format = DumpFormat::PPM;
+
+    /* 0 only dumps when the guest presents and at exit */
+    uint32_t interval_ms = 0;
+
+    bool enabled() const {
+        return !path.empty();
+    }
+};
+
+/* Picks the format from the extension: .ppm or .rgba/.raw */
+dump_options parse_dump_path(const std::string& path);
+
+/* Path for frame number index, or the final frame if index is negative */
+std::string dump_frame_path(const dump_options& opts, int64_t index);
+
+/* Pixels are RGBA8888 words as produced by pixel_convert.h */
+void write_frame(const std::string& path, DumpFormat format, std::span<const uint32_t> pixels,
+                 uint32_t width, uint32_t height);
+
+#endif /* FRAME_DUMP_H */
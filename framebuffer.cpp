@@ -1,11 +1,29 @@
 #include "framebuffer.h"
 
+#ifdef ENABLE_SDL
 #include <SDL2/SDL_render.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <thread>
+#include <vector>
+
+#include <ctime>
+
+#include <unistd.h>
 
+#include "dirty_tracker.h"
 #include "util.h"
 
+/* Soft-dirty tracking misses writes between scanning and resetting, so redraw everything now and then */
+static constexpr std::chrono::seconds full_redraw_interval { 1 };
+
+/* Longest the render thread sleeps before looking at window events again */
+static constexpr std::chrono::nanoseconds event_poll_interval = std::chrono::milliseconds(20);
+
+#ifdef ENABLE_SDL
 static constexpr SDL_PixelFormatEnum gfx_to_sdl_mode[DisplayModes::NMODES] {
     SDL_PIXELFORMAT_RGBA8888,
     SDL_PIXELFORMAT_RGBA8888,
@@ -15,10 +33,13 @@ static constexpr SDL_PixelFormatEnum gfx_to_sdl_mode[DisplayModes::NMODES] {
     SDL_PIXELFORMAT_RGBA8888
 };
 
+#endif
+
 static constexpr uint8_t bytes_per_pixel[DisplayModes::NMODES] {
     1, 1, 1, 2, 3, 4,
 };
 
+#ifdef ENABLE_SDL
 RenderContext::RenderContext(uint32_t mode, uint32_t width, uint32_t height)
     : _mode { mode }, _width { width }, _height { height } {
     if (SDL_CreateWindowAndRenderer(_width, _height,
@@ -46,14 +67,23 @@ RenderContext::~RenderContext() {
     if (_window)   SDL_DestroyWindow(_window);
 }
 
-void RenderContext::redraw(std::span<uint32_t, 256> palette) {
+void RenderContext::update(std::span<uint32_t, 256> palette, uint32_t first_row, uint32_t rows) {
+    SDL_Rect rect {
+        .x = 0,
+        .y = static_cast<int>(first_row),
+        .w = static_cast<int>(_width),
+        .h = static_cast<int>(rows)
+    };
+
+    uint32_t row_bytes = _width * bytes_per_pixel[_mode];
+    const uint8_t* src = reinterpret_cast<uint8_t*>(fb_addr) + first_row * row_bytes;
+
     switch (_mode) {
         case GFX_RGB332:
         case GFX_RGB555:
         case GFX_RGB24:
         case GFX_RGBA32:
-            SDL_UpdateTexture(_texture, NULL,
-                              reinterpret_cast<char*>(fb_addr), _width * bytes_per_pixel[_mode]);
+            SDL_UpdateTexture(_texture, &rect, src, row_bytes);
             break;
 
         case GFX_Y8:
@@ -61,31 +91,165 @@ void RenderContext::redraw(std::span<uint32_t, 256> palette) {
             /* These two are implemented using RGBA8888 */
             uint8_t* pixels;
             int pitch;
-            SDL_LockTexture(_texture, nullptr, reinterpret_cast<void**>(&pixels), &pitch);
+            SDL_LockTexture(_texture, &rect, reinterpret_cast<void**>(&pixels), &pitch);
 
-            for (uint32_t y = 0; y < _height; ++y) {
-                for (uint32_t x = 0; x < _width; ++x) {
-                    uint32_t* pixel = reinterpret_cast<uint32_t*>(&pixels[pitch * y + x * sizeof(uint32_t)]);
+            _pool.run(0, rows, _width, [&](uint32_t first, uint32_t count) {
+                for (uint32_t y = first; y < first + count; ++y) {
+                    const uint8_t* src_row = src + y * _width;
+                    uint32_t* dst_row = reinterpret_cast<uint32_t*>(pixels + pitch * y);
 
-                    uint32_t raw = reinterpret_cast<uint8_t*>(fb_addr)[y * _width + x];
                     if (_mode == GFX_Y8) {
-                        *pixel = (raw << 24) | (raw << 16) | (raw << 8) | 0xFF;
+                        convert_y8(src_row, dst_row, _width);
                     } else {
-                        *pixel = palette[raw];
+                        convert_indexed(src_row, dst_row, _width, palette.data());
                     }
                 }
-            }
+            });
 
             SDL_UnlockTexture(_texture);
         }
     }
+}
 
+void RenderContext::present() {
     SDL_RenderCopy(_renderer, _texture, 0, 0);
     SDL_RenderPresent(_renderer);
 }
+#endif /* ENABLE_SDL */
+
+bool Framebuffer::owns(uintptr_t addr) {
+    return addr >= control_addr && addr < fb_regs_end;
+}
+
+void Framebuffer::set_fps(uint32_t fps) {
+    _fps = fps;
+}
+
+void Framebuffer::set_dump(const dump_options& dump) {
+    _dump = dump;
+}
+
+Framebuffer::stats Framebuffer::get_stats() const {
+    return stats { _frames, _active_ns, _cpu_ns };
+}
+
+size_t Framebuffer::frame_bytes() const {
+    uint32_t mode = _control.mode;
+    if (mode >= DisplayModes::NMODES) {
+        return 0;
+    }
+
+    size_t bytes = static_cast<size_t>(std::min(_control.resx.load(), max_dim)) * std::min(_control.resy.load(), max_dim);
+    return bytes * bytes_per_pixel[mode];
+}
+
+void Framebuffer::set_export(fb_export_header* hdr, int fd) {
+    _export = hdr;
+    _export_fd = fd;
+
+    if (!_export) {
+        return;
+    }
+
+    _export->magic = fb_export_magic;
+    _export->version = fb_export_version;
+    _export->fb_offset = fb_export_header_size;
+    _export->fb_size = fb_max_size;
+
+    _publish(0x0, _control.enable);
+    _publish(0x4, _control.mode);
+    _publish(0x8, _control.resx);
+    _publish(0xc, _control.resy);
+
+    for (size_t i = 0; i < std::size(_shared->palette); ++i) {
+        _publish(sizeof(_control) + i * sizeof(uint32_t), _shared->palette[i]);
+    }
+}
+
+void Framebuffer::set_shared(fb_shared_regs* shared) {
+    fb_shared_regs* next = shared ? shared : &_local;
+    if (next == _shared) {
+        return;
+    }
+
+    std::copy(std::begin(_shared->palette), std::end(_shared->palette), next->palette);
+    next->frames.store(_frames, std::memory_order_relaxed);
+    next->palette_gen.store(_shared->palette_gen.load() + 1, std::memory_order_release);
+
+    next->control.enable.store(_control.enable, std::memory_order_relaxed);
+    next->control.mode.store(_control.mode, std::memory_order_relaxed);
+    next->control.resx.store(_control.resx, std::memory_order_relaxed);
+    next->control.resy.store(_control.resy, std::memory_order_relaxed);
+
+    _shared = next;
+}
+
+std::string Framebuffer::export_path() const {
+    if (!_export) {
+        return { };
+    }
+
+    return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(_export_fd);
+}
+
+void Framebuffer::_publish(uintptr_t offset, uint32_t val) {
+    while (_publish_lock.test_and_set(std::memory_order_acquire));
+
+    _export->seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    switch (offset) {
+        case 0x0: _export->enable.store(val, std::memory_order_relaxed); break;
+        case 0x4: _export->mode.store(val, std::memory_order_relaxed);   break;
+        case 0x8: _export->resx.store(val, std::memory_order_relaxed);   break;
+        case 0xc: _export->resy.store(val, std::memory_order_relaxed);   break;
+        default:
+            _export->palette[(offset - sizeof(_control)) >> 2].store(val, std::memory_order_relaxed);
+    }
+
+    _export->seq.fetch_add(1, std::memory_order_release);
+
+    _publish_lock.clear(std::memory_order_release);
+}
+
+void Framebuffer::_mirror_control(uintptr_t offset, uint32_t val) {
+    switch (offset) {
+        case 0x0: _shared->control.enable.store(val, std::memory_order_release); break;
+        case 0x4: _shared->control.mode.store(val, std::memory_order_release);   break;
+        case 0x8: _shared->control.resx.store(val, std::memory_order_release);   break;
+        case 0xc: _shared->control.resy.store(val, std::memory_order_release);   break;
+    }
+
+    if (_export) {
+        _publish(offset, val);
+    }
+}
+
+bool Framebuffer::_palette_changed() {
+    uint32_t gen = _shared->palette_gen.load(std::memory_order_acquire);
+    if (gen == _palette_gen_seen) {
+        return false;
+    }
+
+    _palette_gen_seen = gen;
+
+    /* The guest may have written any entry directly, republish them all */
+    if (_export) {
+        for (size_t i = 0; i < std::size(_shared->palette); ++i) {
+            _publish(sizeof(_control) + i * sizeof(uint32_t), _shared->palette[i]);
+        }
+    }
+
+    return true;
+}
+
+void Framebuffer::_wake_renderer() {
+    _wake.fetch_add(1);
+    futex_wake(_wake);
+}
 
 bool Framebuffer::handle_write(uintptr_t addr, uint8_t size, uint64_t val) {
-    if (addr >= control_addr && (addr + size) <= (control_addr + sizeof(_control) + sizeof(_palette))) {
+    if (addr >= control_addr && (addr + size) <= fb_regs_end) {
         /* The original implementation allows probing with size=0, but that's impossible on real hardware */
         if (size != sizeof(uint32_t) || (addr % sizeof(uint32_t) != 0)) {
             crash_and_burn("Only aligned 4-byte access allowed");
@@ -102,18 +266,37 @@ bool Framebuffer::handle_write(uintptr_t addr, uint8_t size, uint64_t val) {
                  * by GUI stuff. This can be used to see how i.e. hardware float is faster
                  */
                 // while (!_ctx);
+                _wake_renderer();
                 break;
 
             case 0x4: _control.mode   = val; break;
             case 0x8: _control.resx   = val; break;
             case 0xc: _control.resy   = val; break;
+            case present_addr - control_addr:
+                _presents.fetch_add(1);
+
+                if (_export) {
+                    _export->frame.fetch_add(1, std::memory_order_release);
+                }
+
+                _wake_renderer();
+                return true;
             default: {
-                /* Write into pallette */
+                /* Write into pallette, same as a guest writing the shared page directly */
                 size_t idx = (offset - sizeof(_control)) >> 2;
-                _palette[idx] = val;
+                _shared->palette[idx] = val;
+                _shared->palette_gen.fetch_add(1, std::memory_order_release);
+
+                /* Viewers see a trapped write right away, not only once the renderer gets to it */
+                if (_export) {
+                    _publish(offset, val);
+                }
+
+                return true;
             }
         }
 
+        _mirror_control(offset, val);
         return true;
     }
 
@@ -122,7 +305,7 @@ bool Framebuffer::handle_write(uintptr_t addr, uint8_t size, uint64_t val) {
 }
 
 bool Framebuffer::handle_read(uintptr_t addr, uint8_t size, uint64_t& val) {
-    if (addr >= control_addr && (addr + size) <= (control_addr + sizeof(_control) + sizeof(_palette))) {
+    if (addr >= control_addr && (addr + size) <= fb_regs_end) {
         /* The original implementation allows probing with size=0, but that's impossible on real hardware */
         if (size != sizeof(uint32_t) || (addr % sizeof(uint32_t) != 0)) {
             crash_and_burn("Only aligned 4-byte access allowed");
@@ -134,10 +317,11 @@ bool Framebuffer::handle_read(uintptr_t addr, uint8_t size, uint64_t& val) {
             case 0x4: val = _control.mode;   break;
             case 0x8: val = _control.resx;   break;
             case 0xc: val = _control.resy;   break;
+            case present_addr - control_addr: val = _frames; break;
             default: {
                 /* Read from pallette */
                 size_t idx = (offset - sizeof(_control)) >> 2;
-                val = _palette[idx];
+                val = _shared->palette[idx];
             }
         }
 
@@ -149,14 +333,71 @@ bool Framebuffer::handle_read(uintptr_t addr, uint8_t size, uint64_t& val) {
 }
 
 void Framebuffer::entry(std::stop_token stop) {
-    /* Just spinlock until the window is enabled */
-    while (_control.enable == 0) {
+    /* Make sure a stop request doesn't get lost while the thread is asleep */
+    std::stop_callback wake_on_stop { stop, [this] { _wake_renderer(); } };
+
+    /* Sleep until the window is enabled */
+    for (;;) {
+        uint32_t seen = _wake;
+
+        if (_control.enable != 0) {
+            break;
+        }
+
         if (stop.stop_requested()) {
             return;
         }
+
+        futex_wait(_wake, seen);
     }
 
-    _ctx = std::make_unique<RenderContext>(_control.mode, _control.resx, _control.resy);
+    auto begin = std::chrono::steady_clock::now();
+
+#ifdef ENABLE_SDL
+    if (!_dump.enabled()) {
+        _render(stop);
+    } else
+#endif
+    {
+        _render_offscreen(stop);
+    }
+
+    _active_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+
+    timespec cpu { };
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    _cpu_ns = cpu.tv_sec * 1000000000ull + cpu.tv_nsec;
+}
+
+#ifdef ENABLE_SDL
+void Framebuffer::_render(std::stop_token stop) {
+    uint32_t mode = _control.mode;
+    uint32_t width = _control.resx;
+    uint32_t height = _control.resy;
+
+    _ctx = std::make_unique<RenderContext>(mode, width, height);
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t row_bytes = width * bytes_per_pixel[mode];
+    size_t fb_pages = (row_bytes * height + page_size - 1) / page_size;
+
+    /* Only convert and upload the rows of pages the guest wrote to since the last frame */
+    DirtyTracker tracker { fb_addr, fb_pages };
+    std::vector<uint8_t> dirty_pages;
+
+    /* Only needed when the tracker can't scan and reset atomically */
+    std::chrono::steady_clock::time_point last_full { };
+
+    /* Seen since the last full redraw */
+    bool palette_changed = false;
+
+    /* Once the guest presents frames itself, stop drawing on a timer so it doesn't see tearing */
+    uint32_t presents_seen = _presents;
+    bool guest_paced = _fps == 0;
+
+    auto frame_interval = std::chrono::nanoseconds(_fps ? 1000000000 / _fps : 0);
+    auto next_frame = std::chrono::steady_clock::now();
 
     /* If a stop is requested, wait until the window is closed */
     while (_ctx) {
@@ -168,6 +409,7 @@ void Framebuffer::entry(std::stop_token stop) {
                         case SDLK_ESCAPE:
                         case SDLK_q:
                             _control.enable = 0;
+                            _mirror_control(0x0, 0);
                             _ctx.reset();
 
                             if (stop.stop_requested()) {
@@ -180,10 +422,183 @@ void Framebuffer::entry(std::stop_token stop) {
             }
         }
 
-        if (_ctx) {
-            _ctx->redraw(_palette);
-            /* Constant redraws aren't really necessary */
-            // SDL_Delay(20);
+        if (!_ctx) {
+            break;
+        }
+
+        uint32_t presents = _presents;
+        bool present_requested = presents != presents_seen;
+        presents_seen = presents;
+        guest_paced = guest_paced || present_requested;
+
+        /* Every time around, so viewers get direct palette writes even between frames */
+        palette_changed = _palette_changed() || palette_changed;
+
+        auto now = std::chrono::steady_clock::now();
+        bool frame_due = present_requested || (!guest_paced && now >= next_frame);
+
+        if (frame_due) {
+            bool drawn = false;
+
+            bool periodic_full = !tracker.atomic() && (now - last_full) >= full_redraw_interval;
+
+            if (!tracker.supported() || palette_changed || periodic_full) {
+                tracker.reset();
+                _ctx->update(_shared->palette, 0, height);
+
+                last_full = now;
+                palette_changed = false;
+                drawn = true;
+            } else if (tracker.scan(dirty_pages)) {
+                if (!tracker.atomic()) {
+                    tracker.reset();
+                }
+
+                /* Merge consecutive dirty pages into bands of rows */
+                for (size_t page = 0; page < fb_pages;) {
+                    if (!dirty_pages[page]) {
+                        ++page;
+                        continue;
+                    }
+
+                    size_t first = page;
+                    while (page < fb_pages && dirty_pages[page]) {
+                        ++page;
+                    }
+
+                    uint32_t first_row = (first * page_size) / row_bytes;
+                    uint32_t end_row = std::min<size_t>(height, (page * page_size + row_bytes - 1) / row_bytes);
+
+                    _ctx->update(_shared->palette, first_row, end_row - first_row);
+                    drawn = true;
+                }
+            }
+
+            if (drawn) {
+                _ctx->present();
+                _shared->frames.store(_frames.fetch_add(1) + 1, std::memory_order_release);
+            }
+
+            /* Don't try to catch up on frames missed while the host was busy */
+            next_frame = std::max(next_frame + frame_interval, now);
+        }
+
+        /* Sleep until the next frame or a present, but keep handling window events */
+        uint32_t seen = _wake;
+        if (_presents != presents_seen) {
+            continue;
+        }
+
+        auto timeout = guest_paced ? event_poll_interval
+                                   : std::min<std::chrono::nanoseconds>(next_frame - std::chrono::steady_clock::now(),
+                                                                        event_poll_interval);
+
+        if (timeout.count() > 0) {
+            timespec ts {
+                .tv_sec = static_cast<time_t>(timeout.count() / 1000000000),
+                .tv_nsec = static_cast<long>(timeout.count() % 1000000000)
+            };
+
+            futex_wait(_wake, seen, &ts);
+        }
+    }
+}
+#endif /* ENABLE_SDL */
+
+void Framebuffer::_render_offscreen(std::stop_token stop) {
+    uint32_t mode = _control.mode;
+    uint32_t width = _control.resx;
+    uint32_t height = _control.resy;
+
+    std::vector<uint32_t> pixels;
+    int64_t dumped = 0;
+
+    /* Nothing is converted unless a dump is due, so the guest doesn't pay for it */
+    auto interval = std::chrono::milliseconds(_dump.interval_ms);
+    auto next_dump = std::chrono::steady_clock::now() + interval;
+
+    uint32_t presents_seen = _presents;
+
+    while (!stop.stop_requested()) {
+        uint32_t seen = _wake;
+
+        /* Republish direct palette writes for viewers whether or not a dump is due */
+        _palette_changed();
+
+        uint32_t presents = _presents;
+        bool present_requested = presents != presents_seen;
+        presents_seen = presents;
+
+        auto now = std::chrono::steady_clock::now();
+        if (present_requested || (interval.count() > 0 && now >= next_dump)) {
+            if (_dump.enabled()) {
+                _dump_frame(mode, width, height, dumped++, pixels);
+            }
+
+            _shared->frames.store(_frames.fetch_add(1) + 1, std::memory_order_release);
+            next_dump = std::max(next_dump + interval, now);
+        }
+
+        if (_presents != presents_seen || stop.stop_requested()) {
+            continue;
         }
+
+        if (interval.count() > 0) {
+            auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                next_dump - std::chrono::steady_clock::now());
+
+            if (timeout.count() > 0) {
+                timespec ts {
+                    .tv_sec = static_cast<time_t>(timeout.count() / 1000000000),
+                    .tv_nsec = static_cast<long>(timeout.count() % 1000000000)
+                };
+
+                futex_wait(_wake, seen, &ts);
+            }
+        } else {
+            futex_wait(_wake, seen);
+        }
+    }
+
+    /* Always leave the last frame behind for tests to compare against */
+    if (_dump.enabled()) {
+        _palette_changed();
+        _dump_frame(mode, width, height, -1, pixels);
+    }
+}
+
+void Framebuffer::_dump_frame(uint32_t mode, uint32_t width, uint32_t height, int64_t index,
+                              std::vector<uint32_t>& pixels) {
+    if (mode >= DisplayModes::NMODES || width > max_dim || height > max_dim) {
+        std::cerr << "Framebuffer: not dumping frame with invalid mode " << mode
+            << " or resolution " << width << "x" << height << std::endl;
+        return;
+    }
+
+    pixels.resize(static_cast<size_t>(width) * height);
+
+    const uint8_t* src = reinterpret_cast<uint8_t*>(fb_addr);
+    size_t row_bytes = width * bytes_per_pixel[mode];
+
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t* src_row = src + y * row_bytes;
+        uint32_t* dst_row = &pixels[y * width];
+
+        switch (mode) {
+            case GFX_Y8:      convert_y8(src_row, dst_row, width); break;
+            case GFX_INDEXED: convert_indexed(src_row, dst_row, width, _shared->palette); break;
+            case GFX_RGB332:  convert_rgb332(src_row, dst_row, width); break;
+            case GFX_RGB555:  convert_rgb555(src_row, dst_row, width); break;
+            case GFX_RGB24:   convert_rgb24(src_row, dst_row, width); break;
+            case GFX_RGBA32:  convert_rgba32(src_row, dst_row, width); break;
+        }
+    }
+
+    std::string path = dump_frame_path(_dump, index);
+
+    try {
+        write_frame(path, _dump.format, pixels, width, height);
+    } catch (std::exception& e) {
+        std::cerr << "Framebuffer: " << e.what() << std::endl;
     }
 }
@@ -6,10 +6,19 @@
 #include <stop_token>
 #include <atomic>
 #include <span>
+#include <string>
+#include <vector>
 
+#include <cstddef>
 #include <cstdint>
 
+#ifdef ENABLE_SDL
 #include <SDL2/SDL.h>
+#endif
+
+#include "fb_export.h"
+#include "frame_dump.h"
+#include "pixel_convert.h"
 
 /* Framebuffer compatible with the original one by Koen Putman used in rv64-emu */
 enum DisplayModes {
@@ -36,8 +45,37 @@ static constexpr size_t fb_max_size = max_dim * max_dim * max_pixel_size;
 
 static constexpr uintptr_t control_addr = 0x800;
 static constexpr uintptr_t palette_addr = control_addr + sizeof(ControlInterface);
+/* Writing here asks for the current frame to be shown, reading gives the number of frames shown */
+static constexpr uintptr_t present_addr = palette_addr + 256 * sizeof(uint32_t);
+static constexpr uintptr_t fb_regs_end = present_addr + sizeof(uint32_t);
 static constexpr uintptr_t fb_addr = 0x1000000;
 
+/**
+ * Guest-writable page right below the framebuffer, laid out like the registers at
+ * control_addr so the guest can use it without trapping:
+ * - The control fields mirror the registers and are kept up to date by the host, so
+ *   polling them is free. Changing them still needs a write to the trapping registers.
+ * - The palette is the real one, written in place. Bump palette_gen after changing
+ *   entries and the render thread picks them up.
+ * - frames counts the frames shown, like reading the present register.
+ */
+struct fb_shared_regs {
+    ControlInterface control;
+    uint32_t palette[256];
+    std::atomic_uint32_t frames;
+    std::atomic_uint32_t palette_gen;
+};
+
+static constexpr size_t fb_shared_size = 4096;
+static constexpr uintptr_t fb_shared_addr = fb_addr - fb_shared_size;
+
+static_assert(offsetof(fb_shared_regs, palette) == palette_addr - control_addr, "Same layout as the registers");
+static_assert(offsetof(fb_shared_regs, frames) == present_addr - control_addr, "Same layout as the registers");
+static_assert(sizeof(fb_shared_regs) <= fb_shared_size);
+
+static constexpr uint32_t default_fb_fps = 60;
+
+#ifdef ENABLE_SDL
 class RenderContext {
     uint32_t _mode;
     uint32_t _width;
@@ -47,27 +85,107 @@ class RenderContext {
     SDL_Renderer* _renderer{};
     SDL_Texture* _texture{};
 
+    /* Splits Y8 and INDEXED conversion of large frames across threads */
+    ConvertPool _pool;
+
     public:
     RenderContext(uint32_t mode, uint32_t width, uint32_t height);
     ~RenderContext();
 
-    void redraw(std::span<uint32_t, 256> palette);
+    /* Convert and upload rows [first_row, first_row + rows) */
+    void update(std::span<uint32_t, 256> palette, uint32_t first_row, uint32_t rows);
+    void present();
 };
+#endif /* ENABLE_SDL */
 
 class Framebuffer {
-    /* Palette is mapped behind the ControlInterface structure */
     ControlInterface _control{};
-    std::array<uint32_t, 256> _palette{};
 
+    /* Holds the palette, the guest's page once mapped, see fb_shared_regs */
+    fb_shared_regs _local{};
+    fb_shared_regs* _shared = &_local;
+
+    /* Indexed mode needs a full redraw when the palette changes, render thread only */
+    uint32_t _palette_gen_seen = 0;
+
+    /* Futex bumped on enable and present writes, the render thread sleeps on it */
+    std::atomic_uint32_t _wake{};
+    std::atomic_uint32_t _presents{};
+
+    /* 0 only draws when the guest writes the present register */
+    uint32_t _fps = default_fb_fps;
+
+    std::atomic_uint64_t _frames{};
+    uint64_t _active_ns = 0;
+    uint64_t _cpu_ns = 0;
+
+    /* Setting a dump path renders offscreen, which is the only option without SDL */
+    dump_options _dump;
+
+    /* Control and palette mirrored into the memfd header for external viewers */
+    fb_export_header* _export = nullptr;
+    int _export_fd = -1;
+
+    /* Both the trap handler and the render thread publish, the seqlock takes one writer at a time */
+    std::atomic_flag _publish_lock{};
+
+#ifdef ENABLE_SDL
     std::unique_ptr<RenderContext> _ctx;
+#endif
 
     public:
+    struct stats {
+        uint64_t frames;
+        uint64_t active_ns;  /* Since the display was enabled */
+        uint64_t cpu_ns;     /* Consumed by the render thread */
+    };
+
+    /* Whether addr falls within the control or palette registers */
+    static bool owns(uintptr_t addr);
+
     /* Return true if handled */
     bool handle_write(uintptr_t addr, uint8_t size, uint64_t val);
     bool handle_read(uintptr_t addr, uint8_t size, uint64_t& val);
 
+    void set_fps(uint32_t fps);
+    void set_dump(const dump_options& dump);
+
+    /* Start mirroring registers into hdr, which lives in the memfd fd. Null stops */
+    void set_export(fb_export_header* hdr, int fd);
+
+    /* Keep the palette and mirror the control registers in shared, which the guest has mapped.
+     * Null goes back to a private copy */
+    void set_shared(fb_shared_regs* shared);
+
+    /* Path other processes can open to map the framebuffer, empty if not exported */
+    std::string export_path() const;
+
+    /* Only valid once the rendering thread has been joined */
+    stats get_stats() const;
+
+    /* Size of the current frame at fb_addr, as set through the control registers */
+    size_t frame_bytes() const;
+
     /* Entrypoint for rendering thread */
     void entry(std::stop_token stop);
+
+    private:
+    void _wake_renderer();
+
+    /* Whether the palette changed since the last call, render thread only */
+    bool _palette_changed();
+
+    /* Control value into the guest's mirror and the export header */
+    void _mirror_control(uintptr_t offset, uint32_t val);
+
+    /* Seqlock write of a single control or palette register into the export header */
+    void _publish(uintptr_t offset, uint32_t val);
+    void _render(std::stop_token stop);
+    void _render_offscreen(std::stop_token stop);
+
+    /* Convert the whole frame to RGBA8888 and write it out */
+    void _dump_frame(uint32_t mode, uint32_t width, uint32_t height, int64_t index,
+                     std::vector<uint32_t>& pixels);
 };
 
 #endif /* FRAMEBUFFER_H */
@@ -0,0 +1,58 @@
+#include "guest_context.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <signal.h>
+#include <sys/mman.h>
+
+void guest_context_deleter::operator()(guest_context* ctx) const {
+    ctx->~guest_context();
+    munmap(ctx, guest_region_size);
+}
+
+guest_context_ptr make_guest_context() {
+    /* Over-allocate and trim, mmap only guarantees page alignment */
+    size_t size = guest_region_size * 2;
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error(std::string("Mapping guest context failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    uintptr_t begin = reinterpret_cast<uintptr_t>(map);
+    uintptr_t aligned = (begin + guest_region_size - 1) & ~(guest_region_size - 1);
+
+    if (aligned > begin) {
+        munmap(map, aligned - begin);
+    }
+
+    uintptr_t end = aligned + guest_region_size;
+    if (begin + size > end) {
+        munmap(reinterpret_cast<void*>(end), begin + size - end);
+    }
+
+    guest_context* ctx = new (reinterpret_cast<void*>(aligned)) guest_context { };
+    ctx->jmp = &ctx->exit_jmp;
+
+    return guest_context_ptr { ctx };
+}
+
+void bind_guest_stack(guest_context& ctx) {
+    /* The stack grows down towards the context, keep a bit of distance */
+    uintptr_t stack_begin = (reinterpret_cast<uintptr_t>(&ctx) + sizeof(guest_context) + 4095) & ~uintptr_t { 4095 };
+
+    stack_t stack {
+        .ss_sp = reinterpret_cast<void*>(stack_begin),
+        .ss_flags = 0,
+        .ss_size = reinterpret_cast<uintptr_t>(&ctx) + guest_region_size - stack_begin
+    };
+
+    if (sigaltstack(&stack, nullptr) != 0) {
+        throw std::runtime_error(std::string("sigaltstack fail: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+}
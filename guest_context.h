@@ -0,0 +1,104 @@
+#ifndef GUEST_CONTEXT_H
+#define GUEST_CONTEXT_H
+
+#include <memory>
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/ucontext.h>
+
+#include "bulk_io.h"
+#include "decoder.h"
+#include "serial.h"
+#include "trap_stats.h"
+
+class Checkpointer;
+class Coverage;
+class PerfCounters;
+class Profiler;
+class Tracer;
+struct checkpoint_header;
+
+/* Each context sits at the bottom of its own signal stack, aligned to this */
+static constexpr uintptr_t guest_region_size = 512 * 1024;
+static constexpr uint64_t guest_context_magic = 0x7476637473657567; /* "guestcvt" */
+
+/**
+ * Everything the trap handler needs for one guest. The handler finds it by masking
+ * its stack pointer, which works before gp/tp are restored, so any number of host
+ * threads can each run a guest at the same time.
+ */
+struct guest_context {
+    /* Used by helpers.s, keep these first: set flag, host gp, tp and sp */
+    uint64_t reg_storage[4];
+    jmp_buf* jmp;
+
+    uint64_t magic = guest_context_magic;
+
+    /* The only guest in the process, so it may use the framebuffer and patcher */
+    bool exclusive = false;
+
+    jmp_buf exit_jmp;
+
+    __riscv_mc_gp_state init_regs;
+    __riscv_mc_gp_state result_regs;
+
+    Serial serial;
+    BulkIO bulk_io { &serial };
+    DecodeCache decode_cache;
+
+    /* Time spent handling MMIO traps, in timer ticks */
+    uint64_t mmio_traps;
+    uint64_t mmio_time;
+    TrapStats trap_stats;
+
+    /* Timer at the first guest instruction and at the exit trap, and the traps in between */
+    uint64_t guest_begin;
+    uint64_t guest_end;
+    uint64_t inner_traps;
+    uint64_t inner_time;
+
+    /* Only set while counting, see perf_counters.h */
+    PerfCounters* perf = nullptr;
+
+    /* Sampled from SIGPROF while set, see profiler.h */
+    Profiler* profiler = nullptr;
+
+    /* Handles breakpoints while set, see tracer.h */
+    Tracer* tracer = nullptr;
+
+    /* Also handles breakpoints while set, see coverage.h */
+    Coverage* coverage = nullptr;
+
+    /* Takes checkpoints while set, see checkpoint.h */
+    Checkpointer* checkpointer = nullptr;
+
+    /* Registers the start trap resumes with instead of init_regs */
+    const checkpoint_header* resume = nullptr;
+};
+
+static_assert(offsetof(guest_context, jmp) == 32, "helpers.s depends on this layout");
+static_assert(sizeof(guest_context) < guest_region_size / 2, "Leave room for the signal stack");
+
+struct guest_context_deleter {
+    void operator()(guest_context* ctx) const;
+};
+
+using guest_context_ptr = std::unique_ptr<guest_context, guest_context_deleter>;
+
+guest_context_ptr make_guest_context();
+
+/* Use the stack above ctx as the calling thread's signal stack */
+void bind_guest_stack(guest_context& ctx);
+
+/* Context of the guest that trapped, only valid on a guest's signal stack. Doesn't touch gp/tp */
+static inline guest_context* trapped_guest_context() {
+    uintptr_t sp;
+    asm volatile ("mv %0, sp" : "=r" (sp));
+
+    return reinterpret_cast<guest_context*>(sp & ~(guest_region_size - 1));
+}
+
+#endif /* GUEST_CONTEXT_H */
@@ -1,34 +1,28 @@
-    .data
-
-    # Need to (re)store gp/tp, else shit breaks hard
-    .global reg_storage
-reg_storage:
-    .quad 0 # 1 if regs are set
-    .quad 0 # gp
-    .quad 0 # tp
-    .quad 0 # sp
-
     .text
     .global safe_exit
     .type safe_exit, @function
 safe_exit:
-    # longjmp to return address, with parameter passed to this function
-    la sp, reg_storage
-    ld gp, 8(sp)
-    ld tp, 16(sp)
+    # Set up by the signal handler: a0 = exit type, a1 = guest_context
+    # Restore the host's gp/tp/sp from its reg_storage, then longjmp to its
+    # jmp_buf with the exit type as the return value
+    mv t0, a1
+    mv a1, a0
+
+    ld gp, 8(t0)
+    ld tp, 16(t0)
 
     # restore_regs doesnt restore sp since it's meant to be called from a
     # signal handler, which already has a stack
-    ld sp, 24(sp)
+    ld sp, 24(t0)
 
-    mv a0, a1
-    la a0, g_jmp_buf
+    ld a0, 32(t0)
     call longjmp
 
+    # Need to (re)store gp/tp, else shit breaks hard
+    # a0 = guest_context reg_storage
     .global restore_regs
     .type restore_regs, @function
 restore_regs:
-    la tp, reg_storage
-    ld gp, 8(tp)
-    ld tp, 16(tp)
+    ld gp, 8(a0)
+    ld tp, 16(a0)
     ret
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <regex>
 #include <string_view>
@@ -11,6 +13,11 @@
 #include <csetjmp>
 #include <chrono>
 #include <map>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <condition_variable>
+#include <sstream>
 #include <thread>
 #include <functional>
 #include <csignal>
@@ -19,7 +26,21 @@
 #include <elf.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "bench.h"
+#include "checkpoint.h"
+#include "coverage.h"
+#include "daemon.h"
+#include "decoder.h"
+#include "disk_images.h"
 #include "elf_file.h"
+#include "guest_context.h"
+#include "patcher.h"
+#include "perf_counters.h"
+#include "profiler.h"
+#include "serial.h"
+#include "time_page.h"
+#include "tracer.h"
 #include "util.h"
 
 #ifdef ENABLE_FRAMEBUFFER
@@ -30,24 +51,216 @@
 # error "Can only run on RV64"
 #endif
 
-static __riscv_mc_gp_state g_init_regs;
-static __riscv_mc_gp_state g_result_regs;
-extern "C" {
-    jmp_buf g_jmp_buf;
-}
+static Patcher g_patcher;
+
+/* Shared by every guest in the process, read-only to them */
+static TimePage g_time_page;
+
+/* Opened once from the command line, mapped afresh for every exclusive run */
+static DiskImages g_disks;
+
+/* Owns the framebuffer and patcher, null while several guests share the process */
+static guest_context* g_exclusive_guest;
+
+/* Guest running on this thread, for the crash hook */
+static thread_local guest_context* t_guest;
 
 #ifdef ENABLE_FRAMEBUFFER
 static Framebuffer g_framebuffer;
 #endif
 
 extern "C" [[noreturn]] void safe_exit();
-extern "C" void restore_regs();
-extern "C" uint64_t reg_storage[4];
+extern "C" void restore_regs(uint64_t* reg_storage);
+
+/* Hottest MMIO trap sites listed in the summary */
+static constexpr size_t top_trap_sites = 10;
+
+static constexpr uintptr_t start_addr = 0x208;
+static constexpr uintptr_t exit_addr = 0x278;
+
+/* Stores here are skipped without doing anything, to time the trap itself */
+static constexpr uintptr_t calibrate_addr = 0x2f0;
+
+/* Cost of a no-op trap on this host in timer ticks, the whole round trip and the part inside the handler */
+struct trap_cost {
+    uint64_t round_trip;
+    uint64_t handler;
+};
+
+static trap_cost g_trap_cost;
+
+static Device resolve_device(uintptr_t addr) {
+#ifdef ENABLE_FRAMEBUFFER
+    if (Framebuffer::owns(addr)) {
+        return Device::Framebuffer;
+    }
+#endif
+
+    if (BulkIO::owns(addr)) {
+        return Device::BulkIO;
+    }
+
+    if (DiskImages::owns(addr)) {
+        return Device::Disk;
+    }
+
+    switch (addr) {
+        case start_addr:  return Device::Start;
+        case exit_addr:   return Device::Exit;
+        case serial_addr: return Device::Serial;
+        case calibrate_addr: return Device::Calibrate;
+        case checkpoint_addr: return Device::Checkpoint;
+        default:          return Device::Unknown;
+    }
+}
+
+static mmio_access decode_access(void* pc_ptr, uintptr_t addr) {
+    /* Only fetch the upper half when needed, it might not be mapped after a compressed instruction */
+    uint32_t instr = *static_cast<uint16_t*>(pc_ptr);
+    if ((instr & 0b11) == 0b11) {
+        instr |= static_cast<uint32_t>(static_cast<uint16_t*>(pc_ptr)[1]) << 16;
+    }
+
+    mmio_access res = decode_instruction(instr);
+
+    if (res.kind == AccessKind::Invalid) {
+        char msg[160];
+        sprintf(msg, "Unsupported access instruction 0x%x at %p (PC=%p)",
+                instr, reinterpret_cast<void*>(addr), pc_ptr);
+        crash_and_burn(msg);
+    }
+
+    res.addr = addr;
+    res.device = resolve_device(addr);
+
+    return res;
+}
+
+/* Value of the register an access stores from */
+static uint64_t source_value(const ucontext_t* ctx, const mmio_access& access) {
+    if (access.is_fp) {
+        return ctx->uc_mcontext.__fpregs.__d.__f[access.reg];
+    }
+
+    /* Special case because the PC is stored at idx 0 */
+    return access.reg ? ctx->uc_mcontext.__gregs[access.reg] : 0;
+}
+
+/* Extend a loaded value according to the access and put it in the destination register */
+static void write_result(ucontext_t* ctx, const mmio_access& access, uint64_t val) {
+    uint32_t bits = access.width * 8;
+
+    if (bits < 64) {
+        uint64_t mask = (uint64_t { 1 } << bits) - 1;
+        val &= mask;
+
+        /* Narrower FP values are NaN-boxed */
+        if (access.is_fp || (access.is_signed && (val >> (bits - 1)))) {
+            val |= ~mask;
+        }
+    }
+
+    if (access.is_fp) {
+        ctx->uc_mcontext.__fpregs.__d.__f[access.reg] = val;
+    } else if (access.reg) {
+        /* Ignore writes to register 0 */
+        ctx->uc_mcontext.__gregs[access.reg] = val;
+    }
+}
+
+/* New memory value for an AMO, sc is handled separately */
+static uint64_t amo_result(const mmio_access& access, uint64_t old, uint64_t src) {
+    if (access.width == 4) {
+        /* Word AMOs operate on sign-extended values */
+        old = static_cast<int64_t>(static_cast<int32_t>(old));
+        src = static_cast<int64_t>(static_cast<int32_t>(src));
+    }
+
+    switch (access.amo_op) {
+        case AmoAdd:  return old + src;
+        case AmoSwap: return src;
+        case AmoXor:  return old ^ src;
+        case AmoOr:   return old | src;
+        case AmoAnd:  return old & src;
+        case AmoMin:  return std::min<int64_t>(old, src);
+        case AmoMax:  return std::max<int64_t>(old, src);
+        case AmoMinu: return std::min(old, src);
+        case AmoMaxu: return std::max(old, src);
+        default:      crash_and_burn("unexpected AMO");
+    }
+}
+
+static TrapDevices trap_device(const mmio_access& access) {
+    switch (access.device) {
+        case Device::Start:  return TrapStart;
+        case Device::Exit:   return TrapExit;
+        case Device::Serial: return TrapSerial;
+        case Device::BulkIO: return TrapBulkIO;
+        case Device::Disk:   return TrapDisk;
+#ifdef ENABLE_FRAMEBUFFER
+        case Device::Framebuffer:
+            return (access.addr >= palette_addr && access.addr < present_addr) ? TrapFbPalette : TrapFbControl;
+#endif
+        default:             return TrapOther;
+    }
+}
+
+[[noreturn]] static void unexpected_access(const mmio_access& access, uintptr_t pc) {
+    const char* kind = "read";
+    if (access.kind == AccessKind::Store) {
+        kind = "write";
+    } else if (access.kind == AccessKind::Amo) {
+        kind = "atomic access";
+    }
+
+    char msg[256];
+    sprintf(msg, "Unexpected %s of %i to %p at %lx\n",
+                kind, static_cast<int>(access.width), reinterpret_cast<void*>(access.addr), pc);
+    crash_and_burn(msg);
+}
+
+/* Write a checkpoint of the exclusive guest, from its thread inside a handler */
+static void save_checkpoint(guest_context* guest, const ucontext_t* ctx) {
+    /* Output from before the checkpoint shouldn't show up again after restoring */
+    guest->serial.drain();
+
+    std::array<checkpoint_region, 2> extra { };
+    size_t num_extra = 0;
+
+#ifdef ENABLE_FRAMEBUFFER
+    /* Only the current frame, the rest of the 64 MiB is never looked at */
+    extra[num_extra++] = checkpoint_region {
+        .addr = fb_shared_addr, .size = fb_shared_size, .offset = 0,
+        .prot = PROT_READ | PROT_WRITE, .kind = CheckpointFramebuffer,
+    };
+
+    if (size_t bytes = g_framebuffer.frame_bytes()) {
+        extra[num_extra++] = checkpoint_region {
+            .addr = fb_addr, .size = bytes, .offset = 0,
+            .prot = PROT_READ | PROT_WRITE, .kind = CheckpointFramebuffer,
+        };
+    }
+#endif
+
+    guest->checkpointer->save(ctx, std::span(extra.data(), num_extra));
+}
 
 static void signal_handler(int sig, siginfo_t* info, void* ucontext) {
+    /* Found through the stack pointer, gp and tp still belong to the guest */
+    guest_context* guest = trapped_guest_context();
+
+    if (guest->magic != guest_context_magic) {
+        /* Not on a guest's signal stack, so the host itself crashed and gp/tp are fine */
+        crash_and_burn("Fault outside of a guest");
+    }
+
     /* Restore _very_ important registers first, if they're set */
-    if (reg_storage[0]) {
-        restore_regs();
+    if (guest->reg_storage[0]) {
+        restore_regs(guest->reg_storage);
+    }
+
+    if (guest->perf) {
+        guest->perf->handler_enter();
     }
 
     ucontext_t* ctx = static_cast<ucontext_t*>(ucontext);
@@ -60,137 +273,366 @@ static void signal_handler(int sig, siginfo_t* info, void* ucontext) {
     uint64_t pc = ctx->uc_mcontext.__gregs[REG_PC];
     void* pc_ptr = reinterpret_cast<void*>(pc);
 
-    if (sig == SIGILL) {
+    if (sig == SIGTRAP) {
+        /* Entry into a traced block or one not covered yet, see tracer.h and coverage.h */
+        bool handled = (guest->tracer && guest->tracer->hit(ctx)) || (guest->coverage && guest->coverage->hit(ctx));
+        if (!handled) {
+            crash_and_burn("Breakpoint outside of a traced block");
+        }
+
+    } else if (sig == SIGILL) {
         /* Check for test end marker */
         uint32_t instr = *static_cast<uint32_t*>(pc_ptr);
 
         if (instr == TEST_END_MARKER) {
-            std::copy_n(ctx->uc_mcontext.__gregs, NGREG, g_result_regs);
+            guest->guest_end = read_timer();
+
+            if (guest->perf) {
+                guest->perf->stop();
+            }
+
+            guest->serial.drain();
+
+            std::copy_n(ctx->uc_mcontext.__gregs, NGREG, guest->result_regs);
             ctx->uc_mcontext.__gregs[REG_PC] = reinterpret_cast<uintptr_t>(&safe_exit);
             ctx->uc_mcontext.__gregs[REG_A0] = ExitTypes::ExitByMarker;
+
+            if (guest->checkpointer) {
+                sigaddset(&ctx->uc_sigmask, SIGUSR1);
+            }
+            ctx->uc_mcontext.__gregs[REG_A0 + 1] = reinterpret_cast<uintptr_t>(guest);
         } else {
             crash_and_burn("Illegal instruction");
         }
 
     } else {
+        uint64_t trap_begin = read_timer();
 
-        uint8_t opcode = *static_cast<uint8_t*>(pc_ptr) & 0x7f;
+        mmio_access* access = guest->decode_cache.lookup(pc);
 
-        bool is_compressed = (opcode & 0b11) != 0b11;
+        if (!access) {
+            access = guest->decode_cache.insert(pc, decode_access(pc_ptr, addr));
+        }
 
-        uint64_t value = 0;
-        uint8_t width = 0;
-        bool is_write = false;
-        if (is_compressed) {
-            if ((opcode & 0b11) == 0b00) {
-                /* Quadrant 0 */
-                uint16_t instr = *static_cast<uint16_t*>(pc_ptr);
+        if (access->addr != addr) {
+            /* Same instruction, different target (i.e. a palette upload loop) */
+            access->addr = addr;
+            access->device = resolve_device(addr);
+        }
 
-                uint8_t funct3 = (instr >> 13) & 0b111;
+        bool is_write = access->kind == AccessKind::Store;
+        uint8_t width = access->width;
 
-                /* c.sd or c.sw */
-                switch (funct3) {
-                    case 0b111: is_write = true;  width = 8; break;
-                    case 0b110: is_write = true;  width = 4; break;
-                    case 0b011: is_write = false; width = 8; break;
-                    case 0b010: is_write = false; width = 4; break;
+        uint64_t value = is_write ? source_value(ctx, *access) : 0;
 
-                    default: {
-                        char msg[160];
-                        sprintf(msg, "unsupported quadrant 0 instruction at %p: %x", pc_ptr, instr);
-                        crash_and_burn(msg);
+        switch (access->device) {
+#ifdef ENABLE_FRAMEBUFFER
+            case Device::Framebuffer: {
+                uint64_t loaded = 0;
+
+                /* There's only one display, it's not shared between guests */
+                if (!guest->exclusive) unexpected_access(*access, pc);
+
+                if (is_write && g_framebuffer.handle_write(addr, width, value)) {
+                    g_patcher.record(pc, ctx->uc_mcontext.__gregs[REG_SP]);
+                } else if (access->kind == AccessKind::Load && g_framebuffer.handle_read(addr, width, loaded)) {
+                    write_result(ctx, *access, loaded);
+                } else if (access->kind == AccessKind::Amo) {
+                    uint64_t src = access->amo_src ? ctx->uc_mcontext.__gregs[access->amo_src] : 0;
+
+                    if (access->amo_op == AmoSc) {
+                        /* Always succeeds, there is no reservation to lose */
+                        if (!g_framebuffer.handle_write(addr, width, src)) unexpected_access(*access, pc);
+                        write_result(ctx, *access, 0);
+                    } else {
+                        if (!g_framebuffer.handle_read(addr, width, loaded)
+                            || !g_framebuffer.handle_write(addr, width, amo_result(*access, loaded, src))) {
+                            unexpected_access(*access, pc);
+                        }
+
+                        write_result(ctx, *access, loaded);
                     }
+                } else {
+                    unexpected_access(*access, pc);
+                }
+
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+                break;
+            }
+#endif
+
+            case Device::Exit:
+                /* Controlled exit */
+                if (!is_write) unexpected_access(*access, pc);
+                if (width != 1 && width != 4) crash_and_burn("unexpected write size for exit");
+
+                guest->guest_end = trap_begin;
+
+                if (guest->perf) {
+                    guest->perf->stop();
+                }
+
+                guest->serial.drain();
+
+                std::copy_n(ctx->uc_mcontext.__gregs, NGREG, guest->result_regs);
+                ctx->uc_mcontext.__gregs[REG_PC] = reinterpret_cast<uintptr_t>(&safe_exit);
+                ctx->uc_mcontext.__gregs[REG_A0] = ExitTypes::ExitByStatus;
+                ctx->uc_mcontext.__gregs[REG_A0 + 1] = reinterpret_cast<uintptr_t>(guest);
+
+                /* Back to the emulator, which has SIGUSR1 blocked */
+                if (guest->checkpointer) {
+                    sigaddset(&ctx->uc_sigmask, SIGUSR1);
+                }
+                break;
+
+            case Device::Serial:
+                if (!is_write || !guest->serial.handle_write(addr, width, value)) unexpected_access(*access, pc);
+
+                /* Serial 1-byte output, increment PC for when this handler returns */
+                if (guest->exclusive) {
+                    g_patcher.record(pc, ctx->uc_mcontext.__gregs[REG_SP]);
                 }
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+                break;
 
-                if (is_write) {
-                    value = ctx->uc_mcontext.__gregs[8 + ((instr >> 2) & 0b111)];
+            case Device::BulkIO: {
+                uint64_t loaded = 0;
+
+                if (is_write && guest->bulk_io.handle_write(addr, width, value)) {
+                    /* Done, a command has already been carried out */
+                } else if (access->kind == AccessKind::Load && guest->bulk_io.handle_read(addr, width, loaded)) {
+                    write_result(ctx, *access, loaded);
                 } else {
-                    value = 8 + ((instr >> 2) & 0b111);
+                    unexpected_access(*access, pc);
                 }
-            } else {
-                crash_and_burn("unsupported compressed instruction");
+
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+                break;
             }
-        } else {
-            switch (opcode) {
-                case 0b0100011: is_write = true;  break;
-                case 0b0000011: is_write = false; break;
-                default: {
-                    char msg[160];
-                    sprintf(msg, "Unexpected access opcode 0x%x at %p (PC=%p)", opcode, info->si_addr, pc_ptr);
-                    crash_and_burn(msg);
+
+            case Device::Disk: {
+                uint64_t loaded = 0;
+
+                /* Images are only mapped for an exclusive guest, the others see none */
+                if (access->kind != AccessKind::Load
+                    || (guest->exclusive && !g_disks.handle_read(addr, width, loaded))) {
+                    unexpected_access(*access, pc);
                 }
+
+                write_result(ctx, *access, loaded);
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+                break;
             }
 
-            uint32_t word = *static_cast<uint32_t*>(pc_ptr);
+            case Device::Start:
+                if (!is_write) unexpected_access(*access, pc);
+                if (width != 8) crash_and_burn("unexpected write size for program start");
 
-            width = 1 << ((word >> 12) & 0b111);
+                /* Store a few important registers so we can restore them later */
+                guest->reg_storage[0] = 1;
+                guest->reg_storage[1] = ctx->uc_mcontext.__gregs[REG_TP - 1];
+                guest->reg_storage[2] = ctx->uc_mcontext.__gregs[REG_TP];
+                guest->reg_storage[3] = ctx->uc_mcontext.__gregs[REG_SP];
 
-            if (is_write) {
-                uint8_t reg = (word >> 20) & 0b11111;
-                value = reg ? ctx->uc_mcontext.__gregs[reg] : 0;
-            } else {
-                /* Actually just register idx */
-                value = (word >> 7) & 0b11111;
-            }
+                if (guest->resume) {
+                    /* Pick up where the checkpoint was taken, FP state included */
+                    const checkpoint_header& cp = *guest->resume;
+
+                    std::copy_n(cp.gregs, NGREG, ctx->uc_mcontext.__gregs);
+                    std::copy_n(cp.fregs, 32, ctx->uc_mcontext.__fpregs.__d.__f);
+                    ctx->uc_mcontext.__fpregs.__d.__fcsr = cp.fcsr;
+                } else {
+                    /* Set PC */
+                    ctx->uc_mcontext.__gregs[REG_PC] = value;
+
+                    /* Load initial register values */
+                    /* Disable threading (set libthread-db-search-path /foo) for GDB to not when tp = 0 */
+                    std::copy(&guest->init_regs[1], &guest->init_regs[0] + NGREG, &ctx->uc_mcontext.__gregs[1]);
+                }
+
+                /* A checkpoint may be requested by signal while the guest runs its own code */
+                if (guest->checkpointer) {
+                    sigdelset(&ctx->uc_sigmask, SIGUSR1);
+                }
+
+                /* Count from here on, as close to the first guest instruction as we can get */
+                if (guest->perf) {
+                    guest->perf->start();
+                }
+
+                /* Return context to program code with all registers set to 0 */
+                break;
+
+            case Device::Calibrate:
+                if (!is_write) unexpected_access(*access, pc);
+
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+                break;
+
+            case Device::Checkpoint:
+                /* Only an exclusive guest gets a checkpointer, for the others this does nothing */
+                if (access->kind == AccessKind::Load) {
+                    write_result(ctx, *access, guest->resume != nullptr);
+                } else if (!is_write) {
+                    unexpected_access(*access, pc);
+                }
+
+                /* Resume after the store, without -K it does nothing */
+                ctx->uc_mcontext.__gregs[REG_PC] += access->length;
+
+                if (is_write && guest->checkpointer) {
+                    save_checkpoint(guest, ctx);
+                }
+                break;
+
+            default:
+                unexpected_access(*access, pc);
+        }
+
+        uint64_t ticks = read_timer() - trap_begin;
+
+        guest->mmio_traps += 1;
+        guest->mmio_time += ticks;
+        guest->trap_stats.record(pc, trap_device(*access), ticks);
+
+        if (access->device == Device::Start) {
+            guest->guest_begin = read_timer();
+        } else if (access->device != Device::Exit) {
+            guest->inner_traps += 1;
+            guest->inner_time += ticks;
         }
+    }
+
+    /* Requested by signal outside the guest's code, taken now if it returns to it */
+    if (guest->checkpointer && guest->checkpointer->pending()
+        && guest->checkpointer->in_guest_code(ctx->uc_mcontext.__gregs[REG_PC])) {
+        save_checkpoint(guest, ctx);
+    }
+
+    if (guest->perf) {
+        guest->perf->handler_exit();
+    }
+}
+
+/* SIGUSR1 is only unblocked while a checkpointed guest runs its own code, see Device::Start */
+static void checkpoint_handler(int sig, siginfo_t* info, void* ucontext) {
+    /* Other threads have it blocked, but be sure before trusting the stack pointer */
+    stack_t stack;
+    if (sigaltstack(nullptr, &stack) != 0 || !(stack.ss_flags & SS_ONSTACK)) {
+        return;
+    }
+
+    guest_context* guest = trapped_guest_context();
+    if (guest->magic != guest_context_magic) {
+        return;
+    }
+
+    if (guest->reg_storage[0]) {
+        restore_regs(guest->reg_storage);
+    }
+
+    if (!guest->checkpointer) {
+        return;
+    }
+
+    /* Unblocked for everything run with the guest's mask, including host code it calls into */
+    const ucontext_t* ctx = static_cast<const ucontext_t*>(ucontext);
+    if (guest->checkpointer->in_guest_code(ctx->uc_mcontext.__gregs[REG_PC])) {
+        save_checkpoint(guest, ctx);
+    } else {
+        guest->checkpointer->defer();
+    }
+}
+
+static void profile_handler(int sig, siginfo_t* info, void* ucontext) {
+    guest_context* guest = trapped_guest_context();
+
+    if (guest->magic != guest_context_magic) {
+        /* Not on a guest's signal stack, nothing to sample */
+        return;
+    }
+
+    if (guest->reg_storage[0]) {
+        restore_regs(guest->reg_storage);
+    }
+
+    if (guest->profiler) {
+        guest->profiler->sample(static_cast<const ucontext_t*>(ucontext));
+    }
+}
 
+/* Called by patched store sites instead of trapping, see patcher.h */
+static bool fast_store(uintptr_t addr, uint64_t value, uint8_t size, uintptr_t pc) {
 #ifdef ENABLE_FRAMEBUFFER
-        uint64_t write_dummy;
-        if (is_write && g_framebuffer.handle_write(addr, width, value)) {
-            ctx->uc_mcontext.__gregs[REG_PC] += (is_compressed ? 2 : 4);
-
-            /* Ignore writes to register 0, special case because the PC is stored at idx 0 */
-        } else if (!is_write && g_framebuffer.handle_read(addr, width, value ? ctx->uc_mcontext.__gregs[value] : write_dummy)) {
-            ctx->uc_mcontext.__gregs[REG_PC] += (is_compressed ? 2 : 4);
-        } else 
+    if (g_framebuffer.handle_write(addr, size, value)) {
+        return true;
+    }
 #endif
-        if (is_write && addr == 0x278) {
-            /* Controlled exit */
-            if (width != 1 && width != 4) crash_and_burn("unexpected write size for exit");
 
-            std::copy_n(ctx->uc_mcontext.__gregs, NGREG, g_result_regs);
-            ctx->uc_mcontext.__gregs[REG_PC] = reinterpret_cast<uintptr_t>(&safe_exit);
-            ctx->uc_mcontext.__gregs[REG_A0] = ExitTypes::ExitByStatus;
-        } else if (is_write && addr == 0x200) {
-            /* Serial 1-byte output */
-            if (width != 1) crash_and_burn("unexpected write size for serial");
+    return g_exclusive_guest->serial.handle_write(addr, size, value);
+}
 
-            char ch = value & 0xff;
+#ifdef ENABLE_FRAMEBUFFER
+static void map_framebuffer(std::vector<safe_map>& res) {
+    /* Back the framebuffer with a memfd so other processes can map it, see fb_export.h */
+    int fb_fd = memfd_create("rv64-ume-framebuffer", MFD_CLOEXEC);
+    if (fb_fd < 0 || ftruncate(fb_fd, fb_export_header_size + fb_max_size) != 0) {
+        if (fb_fd >= 0) {
+            close(fb_fd);
+        }
 
-            if (write(STDOUT_FILENO, &ch, 1) != 1) {
-                crash_and_burn("failed to write serial output");
-            }
+        throw std::runtime_error(std::string("Creating framebuffer memfd failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    void* header_map = mmap(nullptr, fb_export_header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
+    if (header_map == MAP_FAILED) {
+        close(fb_fd);
+        throw std::runtime_error(std::string("Mapping framebuffer header failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    /* The header map keeps the memfd open for as long as the run lasts */
+    res.emplace_back(header_map, fb_export_header_size, PROT_READ | PROT_WRITE, fb_fd);
 
-            /* Increment PC for when this handler returns */
-            ctx->uc_mcontext.__gregs[REG_PC] += (is_compressed ? 2 : 4);
+    void* fb_map = mmap(reinterpret_cast<void*>(fb_addr), fb_max_size,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                        fb_fd, fb_export_header_size);
 
-        } else if (is_write && addr == 0x208) {
-            if (width != 8) crash_and_burn("unexpected write size for program start");
+    if (fb_map != reinterpret_cast<void*>(fb_addr)) {
+        if (fb_map != MAP_FAILED) {
+            munmap(fb_map, fb_max_size);
+        }
+        
+        throw std::runtime_error(std::string("Mapping framebuffer failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
 
-            /* Store a few important registers so we can restore them later */
-            reg_storage[0] = 1;
-            reg_storage[1] = ctx->uc_mcontext.__gregs[REG_TP - 1];
-            reg_storage[2] = ctx->uc_mcontext.__gregs[REG_TP];
-            reg_storage[3] = ctx->uc_mcontext.__gregs[REG_SP];
+    res.emplace_back(fb_map, fb_max_size);
 
-            /* Set PC */
-            ctx->uc_mcontext.__gregs[REG_PC] = value;
+    g_framebuffer.set_export(static_cast<fb_export_header*>(header_map), fb_fd);
 
-            /* Load initial register values */
-            /* Disable threading (set libthread-db-search-path /foo) for GDB to not when tp = 0 */
-            std::copy(&g_init_regs[1], &g_init_regs[0] + NGREG, &ctx->uc_mcontext.__gregs[1]);
+    /* Lets the guest poll the control registers and upload palettes without trapping */
+    void* shared_map = mmap(reinterpret_cast<void*>(fb_shared_addr), fb_shared_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
 
-            /* Return context to program code with all registers set to 0 */
-        } else {
-            char msg[256];
-            sprintf(msg, "Unexpected %s of %i to %p at %lx\n",
-                        is_write ? "write" : "read", static_cast<int>(width), info->si_addr, pc);
-            crash_and_burn(msg);
+    if (shared_map != reinterpret_cast<void*>(fb_shared_addr)) {
+        if (shared_map != MAP_FAILED) {
+            munmap(shared_map, fb_shared_size);
         }
+
+        throw std::runtime_error(std::string("Mapping framebuffer registers failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
     }
+
+    res.emplace_back(shared_map, fb_shared_size, PROT_READ | PROT_WRITE);
+
+    g_framebuffer.set_shared(new (shared_map) fb_shared_regs { });
 }
+#endif
 
-static std::vector<safe_map> bind_io(std::span<char> signal_stack) {
+/* Process-wide part of the IO setup, the framebuffer is only mapped for an exclusive guest */
+static std::vector<safe_map> bind_io(bool exclusive) {
     std::vector<safe_map> res;
 
     /* Bind IO by mapping unwritable memory at specific addresses */
@@ -220,42 +662,21 @@ static std::vector<safe_map> bind_io(std::span<char> signal_stack) {
     */
 
 #ifdef ENABLE_FRAMEBUFFER
-    void* fb_map = mmap(reinterpret_cast<void*>(fb_addr), fb_max_size,
-                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
-                        -1, 0);
-
-    if (fb_map != reinterpret_cast<void*>(fb_addr)) {
-        if (fb_map != MAP_FAILED) {
-            munmap(fb_map, fb_max_size);
-        }
-        
-        throw std::runtime_error(std::string("Mapping framebuffer failed: ")
-                + strerrorname_np(errno) + " - " + strerror(errno));
+    if (exclusive) {
+        map_framebuffer(res);
     }
-
-    res.emplace_back(fb_map, fb_max_size);
 #endif
 
-    /* Run signal on separate stack, since we don't know whether the program has a stack at all */
-    
-    stack_t stack {
-        .ss_sp = signal_stack.data() + signal_stack.size_bytes(),
-        .ss_flags = 0,
-        .ss_size = signal_stack.size_bytes()
-    };
-
-    if (sigaltstack(&stack, nullptr) != 0) {
-        throw std::runtime_error(std::string("sigaltstack fail: ")
-                + strerrorname_np(errno) + " - " + strerror(errno));
-    }
+    g_time_page.map(res);
 
     /* Handle SIGSEGV */
     struct sigaction sig { };
     sig.sa_flags = SA_SIGINFO | SA_ONSTACK;
     sig.sa_sigaction = signal_handler;
 
-    /* Block all signals, makes life easy */
+    /* Block all signals, makes life easy. Except profiling ticks, so handler time is sampled as such */
     sigfillset(&sig.sa_mask);
+    sigdelset(&sig.sa_mask, SIGPROF);
 
     if (sigaction(SIGSEGV, &sig, nullptr) != 0) {
         throw std::runtime_error(std::string("Failed to set SIGSEGV handler: ")
@@ -267,6 +688,33 @@ static std::vector<safe_map> bind_io(std::span<char> signal_stack) {
                 + strerrorname_np(errno) + " - " + strerror(errno));
     }
 
+    if (sigaction(SIGTRAP, &sig, nullptr) != 0) {
+        throw std::runtime_error(std::string("Failed to set SIGTRAP handler: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    /* Checkpoint requests, on the guest's signal stack like a trap */
+    struct sigaction usr { };
+    usr.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    usr.sa_sigaction = checkpoint_handler;
+    sigfillset(&usr.sa_mask);
+
+    if (sigaction(SIGUSR1, &usr, nullptr) != 0) {
+        throw std::runtime_error(std::string("Failed to set SIGUSR1 handler: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    /* Also runs on the guest's signal stack, in case a guest is profiled */
+    struct sigaction prof { };
+    prof.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    prof.sa_sigaction = profile_handler;
+    sigfillset(&prof.sa_mask);
+
+    if (sigaction(SIGPROF, &prof, nullptr) != 0) {
+        throw std::runtime_error(std::string("Failed to set SIGPROF handler: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
     return res;
 }
 
@@ -278,85 +726,170 @@ void unbind_io() {
 
     sigaction(SIGSEGV, &sig, nullptr);
     sigaction(SIGILL, &sig, nullptr);
+    sigaction(SIGTRAP, &sig, nullptr);
+    sigaction(SIGUSR1, &sig, nullptr);
+    sigaction(SIGPROF, &sig, nullptr);
 }
 
-static void load_conf(const std::string& path, std::vector<reg_init>& pre, std::vector<reg_init>& post) {
-    /* Simpler, less generic .conf parsing */
-    bool is_pre = false;
-    bool is_post = false;
+/* Command line settings that apply to every run */
+struct run_options {
+    SerialBuffering serial_mode = SerialBuffering::Line;
+    uint32_t patch_threshold = default_patch_threshold;
+    bool decode_cache = true;
+    bool perf_counters = false;
 
-    std::ifstream in { path };
+    /* Empty to not profile */
+    std::string profile_path;
+    uint32_t profile_hz = default_profile_hz;
 
-    for (std::string line; std::getline(in, line);) {
-        if (line.empty()) {
-            continue;
-        }
+    /* Empty to not trace */
+    std::string trace_path;
+    uint32_t trace_budget = default_trace_budget;
 
-        if (!is_pre && !is_post) {
-            if (line == "[pre]") {
-                is_pre = true;
-            } else {
-                throw std::runtime_error("Error: expected [pre] section, got " + line);
-            }
-        } else if (is_pre && !is_post) {
-            if (line == "[post]") {
-                is_pre = false;
-                is_post = true;
-            } else {
-                pre.emplace_back(line);
-            }
-        } else if (!is_pre && is_post) {
-            post.emplace_back(line);
-        }
-    }
-}
+    /* Empty to not collect coverage */
+    std::string coverage_path;
 
-static int run(const std::string& src, std::vector<reg_init> pre) {
-    std::string executable;
+    /* Where checkpoints are written and which one to start from, empty for none */
+    std::string checkpoint_path;
+    std::string restore_path;
+#ifdef ENABLE_FRAMEBUFFER
+    uint32_t fb_fps = default_fb_fps;
+    dump_options fb_dump;
+#endif
+};
 
-    std::vector<reg_init> post;
+/* Time no-op traps from the calling thread, its guest stack has to be bound. See calibrate */
+static void calibrate_traps(guest_context& guest) {
+    static constexpr size_t rounds = 1000;
 
-    bool is_test = src.ends_with(".conf");
+    std::vector<uint64_t> round_trips(rounds);
+    std::vector<uint64_t> handler(rounds);
 
-    if (is_test) {
-        /* We're running a test file */
-        load_conf(src, pre, post);
-        
-        executable = src.substr(0, src.size() - 4) + "bin";
-    } else {
-        executable = src;
+    for (size_t i = 0; i < rounds; ++i) {
+        uint64_t handler_begin = guest.mmio_time;
+        uint64_t begin = read_timer();
+
+        *reinterpret_cast<volatile uint64_t*>(calibrate_addr) = 0;
+
+        round_trips[i] = read_timer() - begin;
+        handler[i] = guest.mmio_time - handler_begin;
     }
 
-    /* Load & map executable, errors if it overlaps with our own process */
-    elf_file elf { executable };
+    /* Medians, the odd preempted round shouldn't count */
+    std::nth_element(round_trips.begin(), round_trips.begin() + rounds / 2, round_trips.end());
+    std::nth_element(handler.begin(), handler.begin() + rounds / 2, handler.end());
 
-    std::vector<char> signal_stack;
-    signal_stack.resize(SIGSTKSZ);
-    
-    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    g_trap_cost = trap_cost { round_trips[rounds / 2], handler[rounds / 2] };
+}
 
-    if (page_size != 4096) {
-        /* Is this even RISC-V? */
-        throw std::runtime_error("Unexpected page size");
-    }
-    
-    auto io_mappings = bind_io(signal_stack);
-    
-    std::fill_n(&g_init_regs[0], NGREG, 0);
-    for (const reg_init& reg : pre) {
-        if (reg.num > 0) {
-            /* addi.conf contains an R0 initializer, we have to ignore this */
-            g_init_regs[reg.num] = reg.val;
-        }
-    }
+/**
+ * Fill g_trap_cost once, up front in the parent. Forked batch tests, daemon requests and
+ * benchmark runs inherit it instead of each paying for the traps before their guest starts
+ */
+static void calibrate() {
+    guest_context_ptr guest = make_guest_context();
+    auto io_mappings = bind_io(false);
 
-#ifdef ENABLE_FRAMEBUFFER
-    std::jthread fb_thread { [](std::stop_token stop) { g_framebuffer.entry(stop); } };
-#endif
+    bind_guest_stack(*guest);
+    calibrate_traps(*guest);
 
-    std::chrono::high_resolution_clock::time_point begin;
+    /* The context goes away, guests bind their own stack when they start */
+    stack_t disable { .ss_sp = nullptr, .ss_flags = SS_DISABLE, .ss_size = 0 };
+    sigaltstack(&disable, nullptr);
+
+    unbind_io();
+}
+
+/* Time the same trap over and over with the decode cache on and off, for -M */
+static void trap_bench() {
+    static constexpr size_t rounds = 100000;
+
+    guest_context_ptr guest = make_guest_context();
+    auto io_mappings = bind_io(false);
+
+    bind_guest_stack(*guest);
+
+    uint64_t freq = timer_frequency();
+    auto print_time = [freq](uint64_t ticks) {
+        if (freq) {
+            std::cerr << (ticks * 1e9 / freq / rounds) << " ns";
+        } else {
+            std::cerr << (static_cast<double>(ticks) / rounds) << " ticks";
+        }
+    };
+
+    for (bool enabled : { true, false }) {
+        guest->decode_cache.reset();
+        guest->decode_cache.set_enabled(enabled);
+        guest->mmio_time = 0;
+
+        uint64_t begin = read_timer();
+        for (size_t i = 0; i < rounds; ++i) {
+            *reinterpret_cast<volatile uint64_t*>(calibrate_addr) = 0;
+        }
+        uint64_t elapsed = read_timer() - begin;
+
+        uint64_t lookups = guest->decode_cache.hits() + guest->decode_cache.misses();
+
+        std::cerr << std::dec << "Decode cache " << (enabled ? "on" : "off") << ": ";
+        print_time(elapsed);
+        std::cerr << " per trap, ";
+        print_time(guest->mmio_time);
+        std::cerr << " of it in the handler, hit rate "
+            << (lookups ? 100.0 * guest->decode_cache.hits() / lookups : 0.0) << "%" << std::endl;
+    }
+
+    stack_t disable { .ss_sp = nullptr, .ss_flags = SS_DISABLE, .ss_size = 0 };
+    sigaltstack(&disable, nullptr);
+
+    unbind_io();
+}
+
+/* Run elf on the calling thread until it exits, the signal handlers need to be bound */
+static run_result run_guest(guest_context& guest, const elf_file& elf, const std::vector<reg_init>& pre,
+                            bool perf_counters) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (page_size != 4096) {
+        /* Is this even RISC-V? */
+        throw std::runtime_error("Unexpected page size");
+    }
+
+    /* Run signal on separate stack, since we don't know whether the program has a stack at all */
+    bind_guest_stack(guest);
+    t_guest = &guest;
+
+    guest.mmio_traps = 0;
+    guest.mmio_time = 0;
+    guest.trap_stats.reset();
+    guest.inner_traps = 0;
+    guest.inner_time = 0;
+    guest.bulk_io.reset();
+    guest.decode_cache.reset();
+
+    /* Opened on this thread, they only count the thread they were opened on */
+    std::optional<PerfCounters> counters;
+    if (perf_counters) {
+        counters.emplace();
+        guest.perf = counters->available() ? &*counters : nullptr;
+    }
+
+    /* Only armed once the signal stack is bound, the handler relies on it */
+    if (guest.profiler) {
+        guest.profiler->start(elf.programs());
+    }
+
+    std::fill_n(&guest.init_regs[0], NGREG, 0);
+    for (const reg_init& reg : pre) {
+        if (reg.num > 0) {
+            /* addi.conf contains an R0 initializer, we have to ignore this */
+            guest.init_regs[reg.num] = reg.val;
+        }
+    }
+
+    std::chrono::high_resolution_clock::time_point begin;
     bool test_marker_encountered = false;
-    switch (setjmp(g_jmp_buf)) {
+    switch (setjmp(guest.exit_jmp)) {
         case ExitTypes::InitialCall:
             begin = std::chrono::high_resolution_clock::now();
 
@@ -375,21 +908,262 @@ static int run(const std::string& src, std::vector<reg_init> pre) {
 
     auto elapsed = std::chrono::high_resolution_clock::now() - begin;
 
+    if (guest.profiler) {
+        guest.profiler->stop();
+    }
+
+    t_guest = nullptr;
+    guest.perf = nullptr;
+
+    run_result res {
+        .status = ExitCodes::Success,
+        .exit_type = test_marker_encountered ? ExitTypes::ExitByMarker : ExitTypes::ExitByStatus,
+        .mismatches = 0,
+        .elapsed_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+        .mmio_traps = guest.mmio_traps,
+        .raw_ns = 0,
+        .handler_ns = 0,
+        .pure_ns = 0,
+        .regs = { },
+        .perf = { },
+    };
+
+    std::copy_n(guest.result_regs, NGREG, res.regs);
+
+    if (uint64_t freq = timer_frequency()) {
+        /* Every trap in between costs the kernel's share of a round trip on top of the handler,
+         * the returns from the start trap and the entry into the exit trap add up to one more */
+        uint64_t kernel = (guest.inner_traps + 1) * (g_trap_cost.round_trip - std::min(g_trap_cost.handler, g_trap_cost.round_trip));
+        uint64_t raw = guest.guest_end - guest.guest_begin;
+        uint64_t pure = raw - std::min(raw, guest.inner_time + kernel);
+
+        res.raw_ns = raw * 1e9 / freq;
+        res.handler_ns = guest.inner_time * 1e9 / freq;
+        res.pure_ns = pure * 1e9 / freq;
+    }
+
+    if (counters && counters->available()) {
+        counters->results(res.perf);
+    }
+
+    return res;
+}
+
+static void print_perf_counts(const run_result& res) {
+    if (std::none_of(std::begin(res.perf), std::end(res.perf), [](const perf_count& c) { return c.valid; })) {
+        std::cerr << "Performance counters unavailable (perf_event_open failed)" << std::endl;
+        return;
+    }
+
+    std::cerr << "Performance counters:          guest        handler" << std::endl;
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (!res.perf[i].valid) {
+            continue;
+        }
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "  %-18s %14" PRIu64 " %14" PRIu64,
+                 perf_event_names[i], res.perf[i].guest, res.perf[i].handler);
+        std::cerr << buf << std::endl;
+    }
+
+    const perf_count& cycles = res.perf[PerfCycles];
+    const perf_count& instructions = res.perf[PerfInstructions];
+    if (cycles.valid && instructions.valid && cycles.guest > 0) {
+        std::cerr << "  guest IPC " << (static_cast<double>(instructions.guest) / cycles.guest) << std::endl;
+    }
+}
+
+static void drain_guest_serial() {
+    if (t_guest) {
+        t_guest->serial.drain();
+    }
+}
+
+/* Compare the final registers against the postconditions, reporting mismatches to out */
+static void check_result(run_result& res, const std::vector<reg_init>& post, std::ostream& out) {
+    for (const reg_init& reg : post) {
+        /* Ignore stray R0 postconditions */
+        if (reg.num == 0) {
+            continue;
+        }
+
+        if (res.regs[reg.num] != reg.val) {
+            out << "Register " << regnames[reg.num]
+                << " expected " << reg.val
+                << " (" << std::hex << std::showbase << reg.val
+                << std::dec << std::noshowbase << ")"
+                << " got " << res.regs[reg.num]
+                << " (" << std::hex << std::showbase << res.regs[reg.num]
+                << std::dec << std::noshowbase << ")"
+                << std::endl;
+
+            res.status = ExitCodes::UnitTestFailed;
+            res.mismatches += 1;
+        }
+    }
+}
+
+/**
+ * Run an already loaded executable as the only guest in the process, verbose prints the summary.
+ * load_begin is the timer before the executable was loaded, 0 if unknown
+ */
+static run_result run(const elf_file& elf, std::vector<reg_init> pre, const std::vector<reg_init>& post,
+                      bool verbose, const run_options& opts, uint64_t load_begin = 0) {
+    /* Reused between runs, i.e. by the daemon and benchmark loops */
+    static guest_context_ptr main_guest = make_guest_context();
+    guest_context& guest = *main_guest;
+
+    auto io_mappings = bind_io(true);
+
+    /* After the ELF so overlaps are reported, and fresh each run so copy-on-write changes are dropped */
+    auto disk_mappings = g_disks.map();
+
+    guest.exclusive = true;
+    g_exclusive_guest = &guest;
+
+    g_patcher.init(elf.programs(), opts.patch_threshold, fast_store);
+    guest.decode_cache.set_enabled(opts.decode_cache);
+
+    /* Over the freshly loaded segments, the guest then starts where the checkpoint was taken */
+    std::optional<CheckpointImage> image;
+    if (!opts.restore_path.empty()) {
+        image.emplace(opts.restore_path);
+        image->restore_programs(elf);
+
+#ifdef ENABLE_FRAMEBUFFER
+        if (image->restore_regions(CheckpointFramebuffer)) {
+            /* The register page came back with it, replay the control registers it mirrors */
+            const ControlInterface& control = reinterpret_cast<const fb_shared_regs*>(fb_shared_addr)->control;
+
+            g_framebuffer.handle_write(control_addr + offsetof(ControlInterface, mode), 4, control.mode);
+            g_framebuffer.handle_write(control_addr + offsetof(ControlInterface, resx), 4, control.resx);
+            g_framebuffer.handle_write(control_addr + offsetof(ControlInterface, resy), 4, control.resy);
+            g_framebuffer.handle_write(control_addr + offsetof(ControlInterface, enable), 4, control.enable);
+        }
+#endif
+
+        guest.resume = &image->header();
+    }
+
+    /* SIGUSR1 stays blocked outside guest code, including in the threads started below */
+    std::optional<Checkpointer> checkpointer;
+    sigset_t checkpoint_signal;
+    sigset_t old_mask;
+    sigemptyset(&checkpoint_signal);
+    sigaddset(&checkpoint_signal, SIGUSR1);
+
+    if (!opts.checkpoint_path.empty()) {
+        checkpointer.emplace(opts.checkpoint_path, elf);
+        guest.checkpointer = &*checkpointer;
+        pthread_sigmask(SIG_BLOCK, &checkpoint_signal, &old_mask);
+    }
+
+    guest.serial.set_mode(opts.serial_mode);
+    std::jthread serial_thread { [&guest](std::stop_token stop) { guest.serial.entry(stop); } };
+    std::jthread time_thread { [](std::stop_token stop) { g_time_page.entry(stop); } };
+
+    /* Don't lose buffered output if the handler bails out */
+    set_crash_hook(drain_guest_serial);
+
+#ifdef ENABLE_FRAMEBUFFER
+    g_framebuffer.set_fps(opts.fb_fps);
+    g_framebuffer.set_dump(opts.fb_dump);
+
+    if (verbose) {
+        std::cerr << "Framebuffer exported at " << g_framebuffer.export_path() << std::endl;
+    }
+    std::jthread fb_thread { [](std::stop_token stop) { g_framebuffer.entry(stop); } };
+#endif
+
+    std::optional<Profiler> profiler;
+    if (!opts.profile_path.empty()) {
+        profiler.emplace(opts.profile_hz, default_profile_samples);
+        guest.profiler = &*profiler;
+    }
+
+    /* Planted every run and removed after, the daemon keeps the executable loaded in between */
+    std::optional<Tracer> tracer;
+    std::jthread trace_thread;
+    if (!opts.trace_path.empty()) {
+        tracer.emplace(opts.trace_path, opts.trace_budget);
+        tracer->instrument(elf);
+        guest.tracer = &*tracer;
+
+        trace_thread = std::jthread { [&tracer](std::stop_token stop) { tracer->entry(stop); } };
+    }
+
+    std::optional<Coverage> coverage;
+    if (!opts.coverage_path.empty()) {
+        coverage.emplace();
+        coverage->instrument(elf);
+        guest.coverage = &*coverage;
+    }
+
+    run_result res = run_guest(guest, elf, pre, opts.perf_counters);
+
+    guest.profiler = nullptr;
+
+    if (tracer) {
+        /* Leave the code as loaded for the next run */
+        guest.tracer = nullptr;
+        tracer->remove();
+
+        trace_thread.request_stop();
+        trace_thread.join();
+    }
+
+    if (coverage) {
+        guest.coverage = nullptr;
+        coverage->remove();
+    }
+
+    guest.resume = nullptr;
+
     unbind_io();
 
+    serial_thread.request_stop();
+    serial_thread.join();
+
+    time_thread.request_stop();
+    time_thread.join();
+
 #ifdef ENABLE_FRAMEBUFFER
     fb_thread.request_stop();
     fb_thread.join();
+
+    /* The header and shared registers are unmapped along with io_mappings */
+    g_framebuffer.set_export(nullptr, -1);
+    g_framebuffer.set_shared(nullptr);
 #endif
 
-    if (!is_test) {
-        if (test_marker_encountered) {
-            std::cerr << "Test marker encountered at " << std::hex << g_result_regs[REG_PC] << std::endl;
+    g_exclusive_guest = nullptr;
+
+    if (checkpointer) {
+        guest.checkpointer = nullptr;
+
+        /* Drop requests that came in after the guest exited */
+        timespec no_wait { };
+        while (sigtimedwait(&checkpoint_signal, nullptr, &no_wait) == SIGUSR1) {
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+        if (checkpointer->failed() > 0) {
+            std::cerr << "Writing " << checkpointer->failed() << " checkpoint(s) to " << checkpointer->path()
+                << " failed: " << strerror(checkpointer->error()) << std::endl;
+        }
+    }
+
+    if (verbose) {
+        if (res.exit_type == ExitTypes::ExitByMarker) {
+            std::cerr << "Test marker encountered at " << std::hex << res.regs[REG_PC] << std::endl;
         } else {
-            std::cerr << "System halt requested at " << std::hex << g_result_regs[REG_PC] << std::endl;
+            std::cerr << "System halt requested at " << std::hex << res.regs[REG_PC] << std::endl;
         }
 
-        auto ns = elapsed.count();
+        auto ns = res.elapsed_ns;
 
         std::cerr << "Took ";
         if (ns < 1e3) {
@@ -404,29 +1178,192 @@ static int run(const std::string& src, std::vector<reg_init> pre) {
 
         std::cerr << std::endl;
 
-        dump_regs(g_result_regs);
+        /* Up to the first guest instruction, lazily mapped segments fault in later as guest time */
+        if (uint64_t freq = timer_frequency(); freq && load_begin) {
+            std::cerr << std::dec << "Startup: " << ((guest.guest_begin - load_begin) * 1e6 / freq)
+                << " us from loading the executable to its entry" << std::endl;
+        }
+
+        if (uint64_t freq = timer_frequency()) {
+            std::cerr << std::dec << "Guest time: " << (res.raw_ns / 1e3) << " us raw, " << (res.handler_ns / 1e3)
+                << " us in handlers, " << (res.pure_ns / 1e3) << " us estimated without traps (a trap takes "
+                << (g_trap_cost.round_trip * 1e9 / freq) << " ns, " << (g_trap_cost.handler * 1e9 / freq)
+                << " ns of it in the handler)" << std::endl;
+        }
+
+        uint64_t serial_bytes = guest.serial.bytes();
+        uint64_t serial_syscalls = guest.serial.syscalls();
+        if (serial_bytes > 0) {
+            std::cerr << std::dec << "Serial: " << serial_bytes << " bytes in " << serial_syscalls
+                << " writes (" << (serial_bytes - serial_syscalls) << " syscalls saved)" << std::endl;
+        }
+
+        if (guest.bulk_io.transfers() > 0) {
+            std::cerr << std::dec << "Bulk IO: " << guest.bulk_io.bytes() << " bytes in "
+                << guest.bulk_io.transfers() << " transfers" << std::endl;
+        }
+
+        if (guest.mmio_traps > 0) {
+            uint64_t lookups = guest.decode_cache.hits() + guest.decode_cache.misses();
+
+            std::cerr << std::dec << "MMIO: " << guest.mmio_traps << " traps, ";
+            if (uint64_t freq = timer_frequency()) {
+                std::cerr << (guest.mmio_time * 1e9 / freq / guest.mmio_traps) << " ns";
+            } else {
+                std::cerr << (static_cast<double>(guest.mmio_time) / guest.mmio_traps) << " ticks";
+            }
+
+            std::cerr << " per trap in handler, decode cache hit rate "
+                << (lookups ? 100.0 * guest.decode_cache.hits() / lookups : 0.0) << "%" << std::endl;
+        }
+
+        if (g_patcher.patched_sites() > 0) {
+            std::cerr << std::dec << "Patched " << g_patcher.patched_sites() << " hot MMIO store sites" << std::endl;
+        }
+
+#ifdef ENABLE_FRAMEBUFFER
+        Framebuffer::stats fb_stats = g_framebuffer.get_stats();
+        if (fb_stats.active_ns > 0) {
+            std::cerr << std::dec << "Framebuffer: " << fb_stats.frames << " frames, "
+                << (fb_stats.frames * 1e9 / fb_stats.active_ns) << " fps, render thread used "
+                << (fb_stats.cpu_ns / 1e6) << " ms CPU (" << (100.0 * fb_stats.cpu_ns / fb_stats.active_ns)
+                << "% of a core)" << std::endl;
+        }
+#endif
+
+        if (guest.mmio_traps > 0) {
+            guest.trap_stats.print(std::cerr, elf, top_trap_sites);
+        }
+
+        if (opts.perf_counters) {
+            print_perf_counts(res);
+        }
+
+        if (profiler) {
+            profiler->print_summary(std::cerr, res.elapsed_ns);
+        }
+
+        if (tracer) {
+            uint64_t freq = timer_frequency();
+            tracer->print_summary(std::cerr, freq ? (g_trap_cost.round_trip - g_trap_cost.handler) * 1e9 / freq : 0);
+        }
+
+        if (coverage) {
+            coverage->print_summary(std::cerr, elf);
+        }
+
+        if (checkpointer && checkpointer->saved() > 0) {
+            std::cerr << std::dec << "Checkpoint: " << checkpointer->saved() << " written, the last one is in "
+                << checkpointer->path() << std::endl;
+        }
+
+        dump_regs(res.regs);
     }
 
-    int res = ExitCodes::Success;
+    if (profiler) {
+        profiler->write_folded(opts.profile_path, elf);
+    }
 
-    for (const reg_init& reg : post) {
-        /* Ignore stray R0 postconditions */
-        if (reg.num == 0) {
-            continue;
+    if (coverage) {
+        coverage->write_lcov(opts.coverage_path, elf);
+    }
+
+    check_result(res, post, std::cerr);
+
+    return res;
+}
+
+static run_result run(const std::string& src, std::vector<reg_init> pre, const run_options& opts) {
+    std::string executable;
+
+    std::vector<reg_init> post;
+
+    bool is_test = src.ends_with(".conf");
+
+    if (is_test) {
+        /* We're running a test file */
+        load_conf(src, pre, post);
+        
+        executable = test_executable(src);
+    } else {
+        executable = src;
+    }
+
+    /* Load & map executable, errors if it overlaps with our own process */
+    uint64_t load_begin = read_timer();
+    elf_file elf { executable };
+
+    return run(elf, std::move(pre), post, !is_test, opts, load_begin);
+}
+
+/* Guests running in threads can't overlap, loading waits until enough of them are unloaded */
+static std::mutex g_load_lock;
+static std::condition_variable g_unloaded;
+static size_t g_loaded_guests;
+
+/* Run a test on the calling thread next to guests on other threads, see run_batch_threaded */
+static run_result run_threaded(const std::string& test, int output_fd, const run_options& opts) {
+    /* One per worker thread, its signal stack is reused for every test on that thread */
+    static thread_local guest_context_ptr guest = make_guest_context();
+
+    std::vector<reg_init> pre;
+    std::vector<reg_init> post;
+    load_conf(test, pre, post);
+
+    elf_file elf { test_executable(test), false };
+
+    {
+        std::unique_lock guard { g_load_lock };
+
+        for (;;) {
+            try {
+                elf.load();
+                break;
+            } catch (std::exception&) {
+                /* Most likely built for the same addresses as a running guest, wait for it to finish */
+                if (g_loaded_guests == 0) {
+                    throw;
+                }
+
+                g_unloaded.wait(guard);
+            }
         }
 
-        if (g_result_regs[reg.num] != reg.val) {
-            std::cerr << "Register " << regnames[reg.num]
-                << " expected " << reg.val
-                << " (" << std::hex << std::showbase << reg.val
-                << std::dec << std::noshowbase << ")"
-                << " got " << g_result_regs[reg.num]
-                << " (" << std::hex << std::showbase << g_result_regs[reg.num]
-                << std::dec << std::noshowbase << ")"
-                << std::endl;
+        ++g_loaded_guests;
+    }
 
-            res = ExitCodes::UnitTestFailed;
+    auto unload = [&elf] {
+        {
+            std::lock_guard guard { g_load_lock };
+            elf.unload();
+            --g_loaded_guests;
         }
+
+        g_unloaded.notify_all();
+    };
+
+    guest->decode_cache.set_enabled(opts.decode_cache);
+    guest->serial.set_mode(opts.serial_mode);
+    guest->serial.set_output(output_fd);
+    guest->bulk_io.set_output(output_fd, output_fd);
+
+    run_result res;
+    try {
+        std::jthread serial_thread { [&](std::stop_token stop) { guest->serial.entry(stop); } };
+        res = run_guest(*guest, elf, pre, opts.perf_counters);
+    } catch (...) {
+        unload();
+        throw;
+    }
+
+    unload();
+
+    std::ostringstream out;
+    check_result(res, post, out);
+
+    std::string mismatches = out.str();
+    if (!mismatches.empty()) {
+        write(output_fd, mismatches.data(), mismatches.size());
     }
 
     return res;
@@ -444,8 +1381,87 @@ R"HERE(
         rX=Y with X a register number and Y the initializer value.
         'testfile' is a unit test configuration file.
 
-    -d enables debug mode in which every decoded instruction is printed
-        to the terminal.
+    -s line|block|none selects how serial output is buffered before being
+        written to stdout, defaults to line.
+
+    -P threshold patches MMIO store sites to call the device directly once
+        they trapped this many times, defaults to 64. 0 disables patching.
+
+    -C disables the decoded instruction cache in the trap handler, to compare
+        the per-trap time reported at exit.
+
+    -M times 100000 no-op traps with the decoded instruction cache on and
+        off, prints the time per trap and hit rate of each and exits.
+
+    -e counts cycles, instructions, cache and branch misses, page faults and
+        context switches with perf_event_open from guest start to exit, split
+        into guest and trap handler time.
+
+    -I file[:cow] maps a disk image at a fixed address in the guest, read-only
+        or with private copy-on-write changes that are dropped at exit. Up to
+        8 images, each 2 MiB aligned from 0x40000000 on. The guest finds them
+        through the registers at 0x300, see disk_images.h. Threaded batch
+        tests don't get any.
+
+    -S file samples the guest's PC and frame pointer chain on a CPU time
+        timer and writes the stacks to file in folded format, one
+        "outer;inner count" line per stack, for flamegraph tools. The guest
+        needs frame pointers for anything but the innermost function.
+        Samples in the emulator itself show up as [emulator].
+    -H hz sets the sampling rate, defaults to 997, at most 10000.
+
+    -F fps sets how often the framebuffer is redrawn, defaults to 60. 0 only
+        redraws when the guest writes the present register.
+    -o file renders the framebuffer offscreen and dumps frames to
+        file-<n>.ppm (or .rgba for raw RGBA) whenever the guest presents, and
+        to file-final.ppm at exit. Builds without SDL always render offscreen.
+    -i ms additionally dumps a frame every ms milliseconds.
+
+    -b path runs every test in a directory (recursively) or listed in a
+        manifest file, each in a separate process.
+    -j jobs sets how many batch tests run in parallel, defaults to the
+        number of cores.
+    -T runs batch tests on threads inside this process instead of forking,
+        tests built for the same addresses wait for each other. The
+        framebuffer and store patching are not available to these tests.
+    -J file writes the batch or benchmark results as JSON.
+
+    -n runs benchmarks the program or test by running it this many times,
+        each in a fresh process with its output discarded, and reports
+        min, median, mean, p95, p99 and stddev of the guest time.
+    -w n sets how many untimed warmup runs come first, defaults to 1.
+    -B file compares the median against an earlier -J benchmark report and
+        exits with 9 if it got slower by more than the threshold.
+    -x percent sets that threshold, defaults to 5.
+
+    -D socket serves run requests on a Unix socket, keeping executables
+        parsed and mapped between requests. See daemon.h for the protocol.
+
+    -d file records every basic block the guest enters, with a timestamp,
+        to file. Blocks are found by sweeping the code sections from their
+        start, every symbol and the entry point, never past the end of a
+        section, and their first instruction replaced by a breakpoint.
+        Print the trace with tracedump (make tracedump). The time per entry
+        is reported at exit, traps included.
+    -k entries stops tracing a block after it was entered this many times,
+        to keep hot loops cheap. Defaults to 10000, 0 traces everything.
+
+    -c file records which basic blocks the guest reached and merges that
+        into file in lcov's tracefile format, with guest addresses as line
+        numbers and a function per symbol. Each block traps only the first
+        time it is reached. Batch tests all add to the same file, except
+        threaded ones (-T) which aren't covered. Can't be combined with -d.
+
+    -K file writes a checkpoint to file whenever the guest writes the
+        register at 0x2f8, or when the emulator gets SIGUSR1. A signal that
+        arrives outside the executable's own code (device handlers, tracing)
+        is held until the next trap back into it. It holds the registers,
+        the executable's writable segments and the framebuffer, with
+        untouched pages left as holes. A later checkpoint replaces it.
+    -R file starts the guest from a checkpoint of the same executable
+        instead of its entry point, so a long initialization can be skipped.
+        Reading the register at 0x2f8 gives 1 in a restored guest. Disk
+        images are mapped fresh, changes to them aren't in the checkpoint.
 )HERE";
 }
 
@@ -456,8 +1472,18 @@ int main(int argc, char** argv) {
     const char* testfile_name = nullptr;
 
     std::vector<reg_init> inits;
+    run_options opts;
 
-    while ((c = getopt(argc, argv, "pr:t:h")) != -1) {
+    const char* batch_path = nullptr;
+    batch_options batch_opts;
+    bool threaded = false;
+
+    bench_options bench_opts;
+
+    const char* daemon_socket = nullptr;
+    bool run_trap_bench = false;
+
+    while ((c = getopt(argc, argv, "pr:t:s:P:CMeI:S:H:d:k:c:K:R:F:o:i:b:j:TJ:n:w:B:x:D:h")) != -1) {
         switch (c) {
             case 'p':
                 /* ignore for compatibility */
@@ -487,6 +1513,175 @@ int main(int argc, char** argv) {
                 testfile_name = optarg;
                 break;
 
+            case 's':
+                try {
+                    opts.serial_mode = parse_serial_buffering(optarg);
+                } catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'P':
+                try {
+                    opts.patch_threshold = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid patch threshold " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'C':
+                opts.decode_cache = false;
+                break;
+
+            case 'M':
+                run_trap_bench = true;
+                break;
+
+            case 'e':
+                opts.perf_counters = true;
+                break;
+
+            case 'I':
+                try {
+                    g_disks.add(optarg);
+                } catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'S':
+                opts.profile_path = optarg;
+                break;
+
+            case 'H':
+                try {
+                    opts.profile_hz = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid sampling rate " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'd':
+                opts.trace_path = optarg;
+                break;
+
+            case 'k':
+                try {
+                    opts.trace_budget = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid trace budget " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'c':
+                opts.coverage_path = optarg;
+                break;
+
+            case 'K':
+                opts.checkpoint_path = optarg;
+                break;
+
+            case 'R':
+                opts.restore_path = optarg;
+                break;
+
+            case 'F':
+#ifdef ENABLE_FRAMEBUFFER
+                try {
+                    opts.fb_fps = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid frame rate " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+#endif
+                break;
+
+            case 'o':
+#ifdef ENABLE_FRAMEBUFFER
+                try {
+                    uint32_t interval_ms = opts.fb_dump.interval_ms;
+                    opts.fb_dump = parse_dump_path(optarg);
+                    opts.fb_dump.interval_ms = interval_ms;
+                } catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+#endif
+                break;
+
+            case 'i':
+#ifdef ENABLE_FRAMEBUFFER
+                try {
+                    opts.fb_dump.interval_ms = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid dump interval " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+#endif
+                break;
+
+            case 'b':
+                batch_path = optarg;
+                break;
+
+            case 'j':
+                try {
+                    batch_opts.jobs = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid job count " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'T':
+                threaded = true;
+                break;
+
+            case 'J':
+                batch_opts.json_path = optarg;
+                bench_opts.json_path = optarg;
+                break;
+
+            case 'n':
+                try {
+                    bench_opts.runs = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid run count " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'w':
+                try {
+                    bench_opts.warmup = std::stoul(optarg, nullptr, 0);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid warmup count " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'B':
+                bench_opts.baseline_path = optarg;
+                break;
+
+            case 'x':
+                try {
+                    bench_opts.threshold_pct = std::stod(optarg);
+                } catch (std::exception& e) {
+                    std::cerr << "Invalid regression threshold " << optarg << std::endl;
+                    return ExitCodes::InitializationError;
+                }
+                break;
+
+            case 'D':
+                daemon_socket = optarg;
+                break;
+
             case 'h':
             default:
                 help(prog);
@@ -497,6 +1692,71 @@ int main(int argc, char** argv) {
     argc -= optind;
     argv += optind;
 
+    /* Both put breakpoints on every block */
+    if (!opts.trace_path.empty() && !opts.coverage_path.empty()) {
+        std::cerr << "Error: Cannot trace and collect coverage at the same time" << std::endl;
+        return ExitCodes::InitializationError;
+    }
+
+    if (run_trap_bench) {
+        try {
+            trap_bench();
+            return ExitCodes::Success;
+        } catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return ExitCodes::AbnormalTermination;
+        }
+    }
+
+    try {
+        calibrate();
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return ExitCodes::AbnormalTermination;
+    }
+
+    if (daemon_socket) {
+        try {
+            return run_daemon(daemon_socket, [&opts](const elf_file& elf, std::vector<reg_init> pre,
+                                                     const std::vector<reg_init>& post) {
+                return run(elf, std::move(pre), post, false, opts);
+            });
+        } catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return ExitCodes::AbnormalTermination;
+        }
+    }
+
+    if (batch_path) {
+        try {
+            if (threaded) {
+                /* Signal handlers are shared, every thread brings its own signal stack */
+                auto io_mappings = bind_io(false);
+                set_crash_hook(drain_guest_serial);
+
+                std::jthread time_thread { [](std::stop_token stop) { g_time_page.entry(stop); } };
+
+                int res = run_batch_threaded(collect_tests(batch_path), batch_opts,
+                                             [&opts](const std::string& test, int output_fd) {
+                    return run_threaded(test, output_fd, opts);
+                });
+
+                time_thread.request_stop();
+                time_thread.join();
+
+                unbind_io();
+                return res;
+            }
+
+            return run_batch(collect_tests(batch_path), batch_opts, [&opts](const std::string& test) {
+                return run(test, {}, opts);
+            });
+        } catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return ExitCodes::AbnormalTermination;
+        }
+    }
+
     /* If no test file is specified, we're running a file as specified from the  */
     if (!testfile_name && argc < 1) {
         std::cerr << "Error: No executable\n" << std::endl;
@@ -504,8 +1764,21 @@ int main(int argc, char** argv) {
         return ExitCodes::InitializationError;
     }
 
+    const char* src = testfile_name ? testfile_name : argv[0];
+
+    if (bench_opts.runs > 0) {
+        try {
+            return run_benchmark(src, bench_opts, [&] {
+                return run(src, inits, opts);
+            });
+        } catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return ExitCodes::AbnormalTermination;
+        }
+    }
+
     try {
-        return run(testfile_name ? testfile_name : argv[0], std::move(inits));
+        return run(src, std::move(inits), opts).status;
     } catch (std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return ExitCodes::AbnormalTermination;
@@ -0,0 +1,344 @@
+#include "patcher.h"
+
+#include <cstring>
+
+#include "util.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Registers clobbered by a call that we have to preserve for the guest, see the psABI */
+static constexpr uint8_t saved_int[] {
+    1, 3, 4, 5, 6, 7, 9, 10, 11, 12, 13, 14, 15, 16, 17, 28, 29, 30, 31
+};
+
+static constexpr uint8_t saved_fp[] {
+    0, 1, 2, 3, 4, 5, 6, 7, 10, 11, 12, 13, 14, 15, 16, 17, 28, 29, 30, 31
+};
+
+static constexpr int32_t fcsr_slot = sizeof(saved_int) * 8;
+static constexpr int32_t fp_base = fcsr_slot + 8;
+static constexpr int32_t frame_size = (fp_base + sizeof(saved_fp) * 8 + 15) & ~15;
+
+/* Upper bound on the size of a single generated trampoline */
+static constexpr size_t max_trampoline_size = 768;
+
+/* Offsets into the header at the start of every trampoline region */
+static constexpr int32_t header_sp = 0;
+static constexpr int32_t header_gp = 8;
+static constexpr int32_t header_tp = 16;
+static constexpr int32_t header_store = 24;
+static constexpr size_t header_size = 64;
+
+enum reg : uint8_t {
+    zero = 0, ra = 1, sp = 2, gp = 3, tp = 4, t0 = 5, t1 = 6, s1 = 9,
+    a0 = 10, a1 = 11, a2 = 12, a3 = 13,
+};
+
+static constexpr uint32_t enc_i(uint32_t op, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+    return ((static_cast<uint32_t>(imm) & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | op;
+}
+
+static constexpr uint32_t enc_s(uint32_t op, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = imm;
+    return (((u >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((u & 0x1f) << 7) | op;
+}
+
+static constexpr uint32_t enc_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t off) {
+    uint32_t u = off;
+    return (((u >> 12) & 1) << 31) | (((u >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15)
+         | (funct3 << 12) | (((u >> 1) & 0xf) << 8) | (((u >> 11) & 1) << 7) | 0x63;
+}
+
+static constexpr uint32_t enc_j(uint32_t rd, int32_t off) {
+    uint32_t u = off;
+    return (((u >> 20) & 1) << 31) | (((u >> 1) & 0x3ff) << 21) | (((u >> 11) & 1) << 20)
+         | (((u >> 12) & 0xff) << 12) | (rd << 7) | 0x6f;
+}
+
+static constexpr uint32_t addi(uint8_t rd, uint8_t rs1, int32_t imm) { return enc_i(0x13, 0, rd, rs1, imm); }
+static constexpr uint32_t ld(uint8_t rd, uint8_t rs1, int32_t imm)   { return enc_i(0x03, 3, rd, rs1, imm); }
+static constexpr uint32_t fld(uint8_t rd, uint8_t rs1, int32_t imm)  { return enc_i(0x07, 3, rd, rs1, imm); }
+static constexpr uint32_t sd(uint8_t rs2, uint8_t rs1, int32_t imm)  { return enc_s(0x23, 3, rs1, rs2, imm); }
+static constexpr uint32_t fsd(uint8_t rs2, uint8_t rs1, int32_t imm) { return enc_s(0x27, 3, rs1, rs2, imm); }
+static constexpr uint32_t jalr(uint8_t rd, uint8_t rs1)              { return enc_i(0x67, 0, rd, rs1, 0); }
+static constexpr uint32_t frcsr(uint8_t rd)                          { return enc_i(0x73, 2, rd, zero, 0x003); }
+static constexpr uint32_t fscsr(uint8_t rs1)                          { return enc_i(0x73, 1, zero, rs1, 0x003); }
+
+static constexpr int saved_slot(uint8_t r) {
+    for (size_t i = 0; i < sizeof(saved_int); ++i) {
+        if (saved_int[i] == r) return i * 8;
+    }
+
+    return -1;
+}
+
+static bool in_jal_range(uintptr_t from, uintptr_t to) {
+    intptr_t delta = to - from;
+    return delta >= -static_cast<intptr_t>(1 << 20) && delta < static_cast<intptr_t>(1 << 20);
+}
+
+namespace {
+    struct emitter {
+        uint32_t* cur;
+
+        uintptr_t pc() const {
+            return reinterpret_cast<uintptr_t>(cur);
+        }
+
+        void emit(uint32_t instr) {
+            *cur++ = instr;
+        }
+
+        /* auipc + addi, rd = target */
+        void emit_la(uint8_t rd, uintptr_t target) {
+            int32_t off = target - pc();
+            int32_t hi = (off + 0x800) & ~0xfff;
+
+            emit((static_cast<uint32_t>(hi) & 0xfffff000) | (rd << 7) | 0x17);
+            emit(addi(rd, rd, off - hi));
+        }
+
+        /* Load the guest's value of r into rd, while sp points at the save area */
+        void emit_guest_reg(uint8_t rd, uint8_t r) {
+            if (r == sp) {
+                emit(addi(rd, sp, frame_size));
+            } else if (int slot = saved_slot(r); slot >= 0) {
+                emit(ld(rd, sp, slot));
+            } else {
+                /* Also covers x0 */
+                emit(addi(rd, r, 0));
+            }
+        }
+
+        void emit_save() {
+            emit(addi(sp, sp, -frame_size));
+
+            for (uint8_t r : saved_int) {
+                emit(sd(r, sp, saved_slot(r)));
+            }
+
+            emit(frcsr(t0));
+            emit(sd(t0, sp, fcsr_slot));
+
+            for (size_t i = 0; i < sizeof(saved_fp); ++i) {
+                emit(fsd(saved_fp[i], sp, fp_base + i * 8));
+            }
+        }
+
+        void emit_restore() {
+            for (size_t i = 0; i < sizeof(saved_fp); ++i) {
+                emit(fld(saved_fp[i], sp, fp_base + i * 8));
+            }
+
+            emit(ld(t0, sp, fcsr_slot));
+            emit(fscsr(t0));
+
+            for (uint8_t r : saved_int) {
+                emit(ld(r, sp, saved_slot(r)));
+            }
+
+            emit(addi(sp, sp, frame_size));
+        }
+    };
+}
+
+void Patcher::init(std::span<const safe_map> programs, uint32_t threshold, store_fn store) {
+    /* From a previous init, the regions unmap themselves */
+    _regions.clear();
+    _writable.clear();
+    for (site& s : _sites) {
+        s.pc.store(0, std::memory_order_relaxed);
+        s.traps = 0;
+    }
+    _patched = 0;
+
+    _threshold = threshold;
+    _store = store;
+
+    if (_threshold == 0) {
+        return;
+    }
+
+    _stack.resize(stack_size);
+
+    uintptr_t host_gp;
+    uintptr_t host_tp;
+    asm volatile ("mv %0, gp" : "=r" (host_gp));
+    asm volatile ("mv %0, tp" : "=r" (host_tp));
+
+    for (const safe_map& program : programs) {
+        uintptr_t begin = reinterpret_cast<uintptr_t>(program.map());
+        uintptr_t end = begin + program.size();
+
+        if (program.prot() & PROT_WRITE) {
+            _writable.emplace_back(static_cast<const char*>(program.map()), program.size());
+        }
+
+        if (!(program.prot() & PROT_EXEC)) {
+            continue;
+        }
+
+        void* map = map_near(begin, end, region_size, jal_range);
+        if (map == MAP_FAILED) {
+            /* Not fatal, sites in this segment just keep trapping */
+            continue;
+        }
+
+        uint64_t* header = static_cast<uint64_t*>(map);
+        header[header_sp / 8] = reinterpret_cast<uintptr_t>(_stack.data() + _stack.size()) & ~uintptr_t { 15 };
+        header[header_gp / 8] = host_gp;
+        header[header_tp / 8] = host_tp;
+        header[header_store / 8] = reinterpret_cast<uintptr_t>(_store);
+
+        mprotect(map, region_size, PROT_READ | PROT_EXEC);
+
+        _regions.push_back(region {
+            .code_begin = begin,
+            .code_end = end,
+            .code_prot = program.prot(),
+            .map = safe_map { map, region_size, PROT_READ | PROT_EXEC },
+            .used = header_size
+        });
+    }
+}
+
+void Patcher::record(uintptr_t pc, uintptr_t guest_sp) {
+    if (_threshold == 0) {
+        return;
+    }
+
+    size_t idx = (pc >> 1) & (max_sites - 1);
+    for (size_t probe = 0; probe < max_sites; ++probe, idx = (idx + 1) & (max_sites - 1)) {
+        site& s = _sites[idx];
+
+        uintptr_t cur = s.pc.load(std::memory_order_relaxed);
+        if (cur == 0 && s.pc.compare_exchange_strong(cur, pc)) {
+            cur = pc;
+        }
+
+        if (cur == pc) {
+            /* Exactly once, a site that couldn't be patched keeps counting but isn't retried */
+            if (++s.traps == _threshold && _patch(pc, guest_sp)) {
+                ++_patched;
+            }
+
+            return;
+        }
+    }
+
+    /* Table is full, this site just won't be patched */
+}
+
+uint32_t Patcher::patched_sites() const {
+    return _patched;
+}
+
+bool Patcher::_patch(uintptr_t pc, uintptr_t guest_sp) {
+    uint32_t word;
+    memcpy(&word, reinterpret_cast<void*>(pc), sizeof(word));
+
+    /* Only uncompressed integer stores, a compressed one has no room for a jal */
+    if ((word & 0x7f) != 0b0100011 || ((word >> 12) & 0b111) > 0b011) {
+        return false;
+    }
+
+    /* The trampoline spills to the guest stack, so it has to look like one */
+    bool stack_ok = false;
+    for (std::span<const char> range : _writable) {
+        uintptr_t begin = reinterpret_cast<uintptr_t>(range.data());
+        if (guest_sp >= (begin + frame_size) && guest_sp <= (begin + range.size())) {
+            stack_ok = true;
+            break;
+        }
+    }
+
+    if (!stack_ok) {
+        return false;
+    }
+
+    region* target = nullptr;
+    for (region& r : _regions) {
+        if (pc >= r.code_begin && pc < r.code_end && (r.used + max_trampoline_size) <= region_size) {
+            target = &r;
+            break;
+        }
+    }
+
+    if (!target) {
+        return false;
+    }
+
+    uintptr_t base = reinterpret_cast<uintptr_t>(target->map.map());
+    uintptr_t tramp = base + target->used;
+
+    if (!in_jal_range(pc, tramp) || !in_jal_range(tramp + max_trampoline_size, pc + 4)) {
+        return false;
+    }
+
+    uint8_t rs1 = (word >> 15) & 0b11111;
+    uint8_t rs2 = (word >> 20) & 0b11111;
+    int32_t imm = static_cast<int32_t>(((word >> 25) << 5) | ((word >> 7) & 0b11111));
+    imm = (imm << 20) >> 20;
+
+    if (mprotect(target->map.map(), region_size, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    emitter e { reinterpret_cast<uint32_t*>(tramp) };
+
+    e.emit_save();
+
+    /* Arguments, everything we clobber is read back from the save area */
+    e.emit_guest_reg(a0, rs1);
+    e.emit(addi(a0, a0, imm));
+    e.emit_guest_reg(a1, rs2);
+    e.emit(addi(a2, zero, 1 << ((word >> 12) & 0b111)));
+    e.emit_la(a3, pc);
+
+    /* Switch to the host's stack, gp and tp and call the device code */
+    e.emit(addi(s1, sp, 0));
+    e.emit_la(t0, base);
+    e.emit(ld(sp, t0, header_sp));
+    e.emit(ld(gp, t0, header_gp));
+    e.emit(ld(tp, t0, header_tp));
+    e.emit(ld(t1, t0, header_store));
+    e.emit(jalr(ra, t1));
+    e.emit(addi(sp, s1, 0));
+
+    uint32_t* branch = e.cur;
+    e.emit(0);
+
+    /* Handled, skip the original store */
+    e.emit_restore();
+    e.emit(enc_j(zero, (pc + 4) - e.pc()));
+
+    /* Not handled, execute the original store so it traps like before */
+    *branch = enc_b(0b000, a0, zero, e.pc() - reinterpret_cast<uintptr_t>(branch));
+    e.emit_restore();
+    e.emit(word);
+    e.emit(enc_j(zero, (pc + 4) - e.pc()));
+
+    target->used = (e.pc() - base + 15) & ~size_t { 15 };
+
+    mprotect(target->map.map(), region_size, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache(reinterpret_cast<char*>(tramp), reinterpret_cast<char*>(e.pc()));
+
+    /* Finally redirect the site itself, it might straddle a page boundary */
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t page_begin = pc & ~(page_size - 1);
+    uintptr_t page_end = (pc + 4 + page_size - 1) & ~(page_size - 1);
+    void* pages = reinterpret_cast<void*>(page_begin);
+
+    if (mprotect(pages, page_end - page_begin, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    uint32_t jump = enc_j(zero, tramp - pc);
+    memcpy(reinterpret_cast<void*>(pc), &jump, sizeof(jump));
+
+    mprotect(pages, page_end - page_begin, target->code_prot);
+    __builtin___clear_cache(reinterpret_cast<char*>(pc), reinterpret_cast<char*>(pc + 4));
+
+    return true;
+}
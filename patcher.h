@@ -0,0 +1,70 @@
+#ifndef PATCHER_H
+#define PATCHER_H
+
+#include <array>
+#include <atomic>
+#include <span>
+#include <vector>
+
+#include <cstdint>
+
+#include "elf_file.h"
+
+static constexpr uint32_t default_patch_threshold = 64;
+
+/**
+ * Rewrites hot MMIO store sites into a jump to a generated trampoline, which calls
+ * straight into the device code instead of going through SIGSEGV. Stores the fast
+ * path doesn't handle (i.e. the exit register) fall back to the original instruction.
+ */
+class Patcher {
+    public:
+    /* Same as the handle_write functions, called with host gp/tp on a separate stack */
+    using store_fn = bool (*)(uintptr_t addr, uint64_t value, uint8_t size, uintptr_t pc);
+
+    private:
+    /* Trampolines need to be within jal range (+-1 MiB) of the patched code */
+    static constexpr uintptr_t jal_range = 1 << 20;
+    static constexpr size_t region_size = 64 * 1024;
+    static constexpr size_t stack_size = 64 * 1024;
+    static constexpr size_t max_sites = 4096;
+
+    struct region {
+        uintptr_t code_begin;
+        uintptr_t code_end;
+        int code_prot;
+        safe_map map;
+        size_t used;
+    };
+
+    struct site {
+        std::atomic_uintptr_t pc;
+        uint32_t traps;
+    };
+
+    uint32_t _threshold = 0;
+    store_fn _store = nullptr;
+
+    std::vector<region> _regions;
+    std::vector<std::span<const char>> _writable;
+    std::vector<char> _stack;
+
+    /* Open addressing, never shrinks so it's safe to use from the handler */
+    std::array<site, max_sites> _sites{};
+
+    uint32_t _patched = 0;
+
+    public:
+    /* Threshold 0 disables patching */
+    void init(std::span<const safe_map> programs, uint32_t threshold, store_fn store);
+
+    /* Count a handled store trap at pc, patching the site once it's hot. Signal-safe */
+    void record(uintptr_t pc, uintptr_t guest_sp);
+
+    uint32_t patched_sites() const;
+
+    private:
+    bool _patch(uintptr_t pc, uintptr_t guest_sp);
+};
+
+#endif /* PATCHER_H */
@@ -0,0 +1,151 @@
+#include "perf_counters.h"
+
+#include <algorithm>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    struct event_config {
+        uint32_t type;
+        uint64_t config;
+    };
+}
+
+/* Hardware events first, they can't join a group led by a software event */
+static constexpr event_config events[NUM_PERF_EVENTS] {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+PerfCounters::PerfCounters() {
+    _fds.fill(-1);
+    _index.fill(-1);
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+        perf_event_attr attr { };
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = _leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        /* Page faults and context switches happen in the kernel, but are attributed to us */
+        if (events[i].type == PERF_TYPE_SOFTWARE) {
+            attr.exclude_kernel = 0;
+        }
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, _leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && attr.exclude_kernel == 0) {
+            /* perf_event_paranoid may not allow counting kernel side at all */
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, _leader, PERF_FLAG_FD_CLOEXEC);
+        }
+
+        if (fd < 0) {
+            continue;
+        }
+
+        if (_leader < 0) {
+            _leader = fd;
+        }
+
+        _fds[i] = fd;
+        _index[i] = _count++;
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    /* Close the leader last */
+    for (size_t i = NUM_PERF_EVENTS; i-- > 0;) {
+        if (_fds[i] >= 0) {
+            close(_fds[i]);
+        }
+    }
+}
+
+bool PerfCounters::available() const {
+    return _leader >= 0;
+}
+
+void PerfCounters::start() {
+    if (_leader < 0) {
+        return;
+    }
+
+    _handler.fill(0);
+    _in_handler = false;
+
+    ioctl(_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    _running = true;
+}
+
+void PerfCounters::stop() {
+    if (!_running) {
+        return;
+    }
+
+    ioctl(_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    _running = false;
+
+    if (!_read(_total)) {
+        _total = { };
+    }
+}
+
+void PerfCounters::handler_enter() {
+    /* The start trap enables the counters halfway through, don't count it */
+    _in_handler = _running && _read(_entry);
+}
+
+void PerfCounters::handler_exit() {
+    if (!_in_handler) {
+        return;
+    }
+
+    _in_handler = false;
+
+    /* If the guest exited in this trap, the totals are as far as the counters got */
+    group_values now;
+    if (_running) {
+        if (!_read(now)) {
+            return;
+        }
+    } else {
+        now = _total;
+    }
+
+    for (size_t i = 0; i < _count; ++i) {
+        _handler[i] += now.values[i] - _entry.values[i];
+    }
+}
+
+void PerfCounters::results(perf_count (&res)[NUM_PERF_EVENTS]) const {
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+        int idx = _index[i];
+
+        if (idx < 0 || _total.nr <= static_cast<uint64_t>(idx)) {
+            res[i] = { };
+            continue;
+        }
+
+        uint64_t total = _total.values[idx];
+        uint64_t handler = std::min(_handler[idx], total);
+
+        res[i] = perf_count { .valid = true, .guest = total - handler, .handler = handler };
+    }
+}
+
+bool PerfCounters::_read(group_values& values) const {
+    size_t size = sizeof(uint64_t) * (1 + _count);
+    return read(_leader, &values, size) == static_cast<ssize_t>(size);
+}
@@ -0,0 +1,63 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+
+#include <cstdint>
+
+#include "util.h"
+
+/**
+ * Counter group for the calling thread, enabled by the start trap and disabled by
+ * the exit trap. Reading the group on handler entry and exit splits every count
+ * into guest and handler time. Events the kernel or hardware doesn't support are
+ * left out, i.e. hardware events inside most VMs.
+ */
+class PerfCounters {
+    /* Values as read with PERF_FORMAT_GROUP */
+    struct group_values {
+        uint64_t nr;
+        uint64_t values[NUM_PERF_EVENTS];
+    };
+
+    int _leader = -1;
+    std::array<int, NUM_PERF_EVENTS> _fds;
+
+    /* Position of each event within the group read, -1 if it couldn't be opened */
+    std::array<int, NUM_PERF_EVENTS> _index;
+    size_t _count = 0;
+
+    bool _running = false;
+    bool _in_handler = false;
+
+    group_values _entry{};
+    group_values _total{};
+    std::array<uint64_t, NUM_PERF_EVENTS> _handler{};
+
+    public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const;
+
+    /* Reset and enable the group, signal-safe */
+    void start();
+
+    /* Disable the group and keep the totals, signal-safe */
+    void stop();
+
+    /* Bracket the trap handler, signal-safe */
+    void handler_enter();
+    void handler_exit();
+
+    /* Fill in the counts of a finished run */
+    void results(perf_count (&res)[NUM_PERF_EVENTS]) const;
+
+    private:
+    bool _read(group_values& values) const;
+};
+
+#endif /* PERF_COUNTERS_H */
@@ -0,0 +1,92 @@
+/* Measures the framebuffer pixel conversion throughput, build with `make pixel-bench` */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "pixel_convert.h"
+
+namespace {
+    struct resolution {
+        uint32_t width;
+        uint32_t height;
+    };
+}
+
+static constexpr resolution resolutions[] {
+    { 320, 240 },
+    { 640, 480 },
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 4096, 4096 },
+};
+
+/* Enough to get past the first few frames' page faults and frequency ramp-up */
+static constexpr std::chrono::milliseconds min_duration { 500 };
+
+/* Without a pool the whole frame is converted on the calling thread */
+static double measure(ConvertPool* pool, bool indexed, resolution res) {
+    std::vector<uint8_t> src(static_cast<size_t>(res.width) * res.height);
+    std::vector<uint32_t> dst(src.size());
+    std::vector<uint32_t> palette(256);
+
+    for (size_t i = 0; i < src.size(); ++i) {
+        src[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    for (size_t i = 0; i < palette.size(); ++i) {
+        palette[i] = static_cast<uint32_t>(i * 0x01020304);
+    }
+
+    ConvertPool::band_fn fn = [&](uint32_t first, uint32_t count) {
+        for (uint32_t y = first; y < first + count; ++y) {
+            if (indexed) {
+                convert_indexed(&src[y * res.width], &dst[y * res.width], res.width, palette.data());
+            } else {
+                convert_y8(&src[y * res.width], &dst[y * res.width], res.width);
+            }
+        }
+    };
+
+    uint64_t frames = 0;
+    auto begin = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration { };
+
+    while (elapsed < min_duration) {
+        if (pool) {
+            pool->run(0, res.height, res.width, fn);
+        } else {
+            fn(0, res.height);
+        }
+
+        ++frames;
+        elapsed = std::chrono::steady_clock::now() - begin;
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    return frames * src.size() / seconds / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned workers = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 0;
+
+    ConvertPool pool { workers };
+
+    std::cout << "mode      resolution   1 thread (Mpx/s)   pool (Mpx/s)" << std::endl;
+
+    for (bool indexed : { false, true }) {
+        for (auto res : resolutions) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "%-9s %4ux%-4u    %16.1f %14.1f",
+                     indexed ? "INDEXED" : "Y8", res.width, res.height,
+                     measure(nullptr, indexed, res), measure(&pool, indexed, res));
+            std::cout << buf << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include "pixel_convert.h"
+
+#include <algorithm>
+
+#ifdef __riscv_vector
+#include <riscv_vector.h>
+#endif
+
+#ifdef __riscv_vector
+
+void convert_y8(const uint8_t* src, uint32_t* dst, size_t count) {
+    while (count > 0) {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+
+        /* Broadcast the byte into R, G and B by multiplying, alpha is opaque */
+        vuint32m4_t raw = __riscv_vzext_vf4_u32m4(__riscv_vle8_v_u8m1(src, vl), vl);
+        vuint32m4_t rgba = __riscv_vor_vx_u32m4(__riscv_vmul_vx_u32m4(raw, 0x01010100, vl), 0xFF, vl);
+        __riscv_vse32_v_u32m4(dst, rgba, vl);
+
+        src += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+void convert_indexed(const uint8_t* src, uint32_t* dst, size_t count, const uint32_t* palette) {
+    while (count > 0) {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+
+        /* Gather from the palette, indexed loads take byte offsets */
+        vuint32m4_t raw = __riscv_vzext_vf4_u32m4(__riscv_vle8_v_u8m1(src, vl), vl);
+        vuint32m4_t offsets = __riscv_vsll_vx_u32m4(raw, 2, vl);
+        __riscv_vse32_v_u32m4(dst, __riscv_vluxei32_v_u32m4(palette, offsets, vl), vl);
+
+        src += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+#else
+
+/* Plain loops over contiguous rows, simple enough for the compiler to vectorize */
+void convert_y8(const uint8_t* src, uint32_t* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (static_cast<uint32_t>(src[i]) * 0x01010100) | 0xFF;
+    }
+}
+
+void convert_indexed(const uint8_t* src, uint32_t* dst, size_t count, const uint32_t* palette) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = palette[src[i]];
+    }
+}
+
+#endif /* __riscv_vector */
+
+void convert_rgb332(const uint8_t* src, uint32_t* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t r = (src[i] >> 5) & 0x7;
+        uint32_t g = (src[i] >> 2) & 0x7;
+        uint32_t b = src[i] & 0x3;
+
+        /* Replicate the high bits into the low ones so full intensity stays 0xFF */
+        r = (r << 5) | (r << 2) | (r >> 1);
+        g = (g << 5) | (g << 2) | (g >> 1);
+        b = b * 0x55;
+
+        dst[i] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+    }
+}
+
+void convert_rgb555(const uint8_t* src, uint32_t* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t raw = src[2 * i] | (src[2 * i + 1] << 8);
+
+        uint32_t r = (raw >> 10) & 0x1F;
+        uint32_t g = (raw >> 5) & 0x1F;
+        uint32_t b = raw & 0x1F;
+
+        r = (r << 3) | (r >> 2);
+        g = (g << 3) | (g >> 2);
+        b = (b << 3) | (b >> 2);
+
+        dst[i] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+    }
+}
+
+void convert_rgb24(const uint8_t* src, uint32_t* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (src[3 * i] << 24) | (src[3 * i + 1] << 16) | (src[3 * i + 2] << 8) | 0xFF;
+    }
+}
+
+void convert_rgba32(const uint8_t* src, uint32_t* dst, size_t count) {
+    /* RGBA8888 is a native endian word, same as the output */
+    std::copy_n(reinterpret_cast<const uint32_t*>(src), count, dst);
+}
+
+ConvertPool::ConvertPool(unsigned workers) {
+    if (workers == 0) {
+        /* Leave the rest of the CPUs to the guest */
+        workers = std::min(std::thread::hardware_concurrency() / 2, max_workers);
+    }
+
+    for (unsigned i = 0; i < workers; ++i) {
+        _workers.emplace_back(&ConvertPool::_entry, this, i);
+    }
+}
+
+ConvertPool::~ConvertPool() {
+    {
+        std::lock_guard guard { _lock };
+        _stopping = true;
+    }
+
+    _work_cv.notify_all();
+
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void ConvertPool::run(uint32_t first_row, uint32_t rows, uint32_t width, const band_fn& fn) {
+    if (_workers.empty() || static_cast<size_t>(rows) * width < min_pixels) {
+        fn(first_row, rows);
+        return;
+    }
+
+    /* The calling thread takes the first band itself */
+    uint32_t bands = _workers.size() + 1;
+    uint32_t band_rows = (rows + bands - 1) / bands;
+
+    {
+        std::lock_guard guard { _lock };
+        _fn = &fn;
+        _first_row = first_row;
+        _band_rows = band_rows;
+        _end_row = first_row + rows;
+        _pending = _workers.size();
+        ++_generation;
+    }
+
+    _work_cv.notify_all();
+
+    fn(first_row, std::min(band_rows, rows));
+
+    std::unique_lock guard { _lock };
+    _done_cv.wait(guard, [this] { return _pending == 0; });
+    _fn = nullptr;
+}
+
+void ConvertPool::_entry(unsigned index) {
+    uint64_t seen = 0;
+
+    for (;;) {
+        std::unique_lock guard { _lock };
+        _work_cv.wait(guard, [&] { return _stopping || _generation != seen; });
+
+        if (_stopping) {
+            return;
+        }
+
+        seen = _generation;
+
+        const band_fn& fn = *_fn;
+        uint32_t begin = std::min(_first_row + (index + 1) * _band_rows, _end_row);
+        uint32_t end = std::min(begin + _band_rows, _end_row);
+        guard.unlock();
+
+        if (begin < end) {
+            fn(begin, end - begin);
+        }
+
+        guard.lock();
+        if (--_pending == 0) {
+            _done_cv.notify_one();
+        }
+    }
+}
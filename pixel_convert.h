@@ -0,0 +1,66 @@
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+/* Expand count 8 bit pixels to RGBA8888, vectorized with RVV when available */
+void convert_y8(const uint8_t* src, uint32_t* dst, size_t count);
+void convert_indexed(const uint8_t* src, uint32_t* dst, size_t count, const uint32_t* palette);
+
+/* Same for the modes SDL converts itself, expanding channels the way SDL does */
+void convert_rgb332(const uint8_t* src, uint32_t* dst, size_t count);
+void convert_rgb555(const uint8_t* src, uint32_t* dst, size_t count);
+void convert_rgb24(const uint8_t* src, uint32_t* dst, size_t count);
+void convert_rgba32(const uint8_t* src, uint32_t* dst, size_t count);
+
+/**
+ * Small pool of threads splitting row conversion into bands. Frames below
+ * min_pixels are done inline, waking the workers would cost more than it saves.
+ */
+class ConvertPool {
+    public:
+    using band_fn = std::function<void(uint32_t first_row, uint32_t rows)>;
+
+    static constexpr size_t min_pixels = 256 * 1024;
+    static constexpr unsigned max_workers = 4;
+
+    private:
+    std::mutex _lock;
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+
+    const band_fn* _fn = nullptr;
+    uint32_t _first_row = 0;
+    uint32_t _band_rows = 0;
+    uint32_t _end_row = 0;
+
+    /* Bumped per job so workers don't pick the same one up twice */
+    uint64_t _generation = 0;
+    unsigned _pending = 0;
+    bool _stopping = false;
+
+    std::vector<std::thread> _workers;
+
+    public:
+    /* 0 workers picks based on the number of CPUs */
+    explicit ConvertPool(unsigned workers = 0);
+    ~ConvertPool();
+
+    ConvertPool(const ConvertPool&) = delete;
+    ConvertPool& operator=(const ConvertPool&) = delete;
+
+    /* Call fn over [first_row, first_row + rows) in bands, returns once all are done */
+    void run(uint32_t first_row, uint32_t rows, uint32_t width, const band_fn& fn);
+
+    private:
+    void _entry(unsigned index);
+};
+
+#endif /* PIXEL_CONVERT_H */
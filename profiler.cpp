@@ -0,0 +1,190 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "util.h"
+
+Profiler::Profiler(uint32_t hz, size_t max_samples) : _hz { std::clamp<uint32_t>(hz, 1, max_hz) } {
+    /* Touch it all now so the handler never faults memory in */
+    _buffer.assign(max_samples * (1 + max_depth), 0);
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+void Profiler::start(std::span<const safe_map> programs) {
+    _code.clear();
+    _data.clear();
+
+    for (const safe_map& program : programs) {
+        uintptr_t begin = reinterpret_cast<uintptr_t>(program.map());
+        auto range = std::make_pair(begin, begin + program.size());
+
+        if (program.prot() & PROT_EXEC) {
+            _code.push_back(range);
+        }
+
+        if (program.prot() & PROT_WRITE) {
+            _data.push_back(range);
+        }
+    }
+
+    sigevent event { };
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = static_cast<pid_t>(syscall(SYS_gettid));
+
+    /* CPU time of this thread, so time blocked on serial output isn't sampled */
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &_timer) != 0) {
+        throw std::runtime_error(std::string("Creating profiling timer failed: ") + strerror(errno));
+    }
+
+    long interval_ns = 1000000000 / _hz;
+    itimerspec spec {
+        .it_interval = { .tv_sec = interval_ns / 1000000000, .tv_nsec = interval_ns % 1000000000 },
+        .it_value = { .tv_sec = interval_ns / 1000000000, .tv_nsec = interval_ns % 1000000000 },
+    };
+
+    if (timer_settime(_timer, 0, &spec, nullptr) != 0) {
+        timer_delete(_timer);
+        throw std::runtime_error(std::string("Arming profiling timer failed: ") + strerror(errno));
+    }
+
+    _armed = true;
+}
+
+void Profiler::stop() {
+    if (_armed) {
+        timer_delete(_timer);
+        _armed = false;
+    }
+}
+
+bool Profiler::_in(const std::vector<std::pair<uintptr_t, uintptr_t>>& ranges, uintptr_t addr, size_t size) const {
+    for (const auto& [begin, end] : ranges) {
+        if (addr >= begin && addr + size <= end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Profiler::sample(const ucontext_t* ctx) {
+    uint64_t begin = read_timer();
+
+    _samples += 1;
+
+    uintptr_t pc = ctx->uc_mcontext.__gregs[REG_PC];
+    if (!_in(_code, pc, 2)) {
+        _emulator += 1;
+        _ticks += read_timer() - begin;
+        return;
+    }
+
+    if (_used + 1 + max_depth > _buffer.size()) {
+        _dropped += 1;
+        _ticks += read_timer() - begin;
+        return;
+    }
+
+    uint64_t* out = &_buffer[_used];
+    size_t depth = 0;
+
+    out[1 + depth++] = pc;
+
+    /* With frame pointers the saved ra is at fp - 8 and the caller's fp at fp - 16 */
+    uintptr_t fp = ctx->uc_mcontext.__gregs[REG_S0];
+    while (depth < max_depth && (fp & 7) == 0 && fp >= 16 && _in(_data, fp - 16, 16)) {
+        uintptr_t ra = reinterpret_cast<const uint64_t*>(fp)[-1];
+        uintptr_t next = reinterpret_cast<const uint64_t*>(fp)[-2];
+
+        if (!_in(_code, ra, 2)) {
+            break;
+        }
+
+        out[1 + depth++] = ra;
+
+        /* Stacks grow down, so callers' frames must be higher up */
+        if (next <= fp) {
+            break;
+        }
+
+        fp = next;
+    }
+
+    out[0] = depth;
+    _used += 1 + depth;
+
+    _ticks += read_timer() - begin;
+}
+
+void Profiler::write_folded(const std::string& path, const elf_file& elf) const {
+    std::map<std::string, uint64_t> stacks;
+
+    for (size_t pos = 0; pos < _used;) {
+        size_t depth = _buffer[pos];
+        const uint64_t* pcs = &_buffer[pos + 1];
+
+        std::string stack;
+        for (size_t i = depth; i-- > 0;) {
+            /* Return addresses point after the call, look up the call itself */
+            uintptr_t addr = i == 0 ? pcs[i] : pcs[i] - 1;
+
+            const elf_symbol* sym = elf.find_symbol(addr);
+            if (!stack.empty()) {
+                stack += ';';
+            }
+
+            if (sym) {
+                stack += sym->name;
+            } else {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "0x%lx", addr);
+                stack += buf;
+            }
+        }
+
+        stacks[stack] += 1;
+        pos += 1 + depth;
+    }
+
+    if (_emulator > 0) {
+        stacks["[emulator]"] += _emulator;
+    }
+
+    std::ofstream out { path };
+    if (!out) {
+        throw std::runtime_error("Could not open " + path);
+    }
+
+    for (const auto& [stack, count] : stacks) {
+        out << stack << " " << count << "\n";
+    }
+}
+
+void Profiler::print_summary(std::ostream& out, uint64_t guest_ns) const {
+    uint64_t freq = timer_frequency();
+
+    out << std::dec << "Profile: " << _samples << " samples at " << _hz << " Hz, "
+        << _emulator << " in the emulator, " << _dropped << " dropped";
+
+    if (freq && guest_ns) {
+        double overhead_ns = _ticks * 1e9 / freq;
+        out << ", sampling took " << (overhead_ns / 1e6) << " ms ("
+            << (100.0 * overhead_ns / guest_ns) << "% of the run)";
+    }
+
+    out << std::endl;
+}
@@ -0,0 +1,79 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <ostream>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+#include <signal.h>
+#include <sys/ucontext.h>
+
+#include "elf_file.h"
+
+static constexpr uint32_t default_profile_hz = 997;
+
+/* Roughly 8 MiB of full-depth stacks, about half a minute at the default rate */
+static constexpr size_t default_profile_samples = 32768;
+
+/**
+ * Samples the guest PC and its frame pointer chain from a SIGPROF timer on the
+ * guest's thread. Samples go into a buffer sized up front, so the handler never
+ * allocates and memory stays bounded; once it's full further samples are only
+ * counted. Samples taken outside guest code are attributed to the emulator.
+ */
+class Profiler {
+    public:
+    static constexpr uint32_t max_hz = 10000;
+    static constexpr size_t max_depth = 32;
+
+    private:
+    uint32_t _hz;
+
+    /* Per sample: the depth followed by that many PCs, innermost first */
+    std::vector<uint64_t> _buffer;
+    size_t _used = 0;
+
+    std::vector<std::pair<uintptr_t, uintptr_t>> _code;
+    std::vector<std::pair<uintptr_t, uintptr_t>> _data;
+
+    uint64_t _samples = 0;
+    uint64_t _dropped = 0;
+    uint64_t _emulator = 0;
+
+    /* Time spent taking samples, in timer ticks */
+    uint64_t _ticks = 0;
+
+    timer_t _timer{};
+    bool _armed = false;
+
+    public:
+    /* Room for roughly max_samples full-depth stacks */
+    Profiler(uint32_t hz, size_t max_samples);
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    /* Start sampling the calling thread, the programs tell guest code and stacks apart */
+    void start(std::span<const safe_map> programs);
+    void stop();
+
+    /* Called from the SIGPROF handler, signal-safe */
+    void sample(const ucontext_t* ctx);
+
+    /* One "outer;...;inner count" line per unique stack, for flamegraph tools */
+    void write_folded(const std::string& path, const elf_file& elf) const;
+
+    void print_summary(std::ostream& out, uint64_t guest_ns) const;
+
+    private:
+    bool _in(const std::vector<std::pair<uintptr_t, uintptr_t>>& ranges, uintptr_t addr, size_t size) const;
+};
+
+#endif /* PROFILER_H */
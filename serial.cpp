@@ -0,0 +1,168 @@
+#include "serial.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "util.h"
+
+/* How long the writer sleeps before flushing whatever is pending anyway */
+static constexpr timespec writer_timeout { .tv_sec = 0, .tv_nsec = 100'000'000 };
+
+/* Give up on draining after this many timeouts, so a stuck writer can't hang a crash */
+static constexpr int max_drain_attempts = 10;
+
+SerialBuffering parse_serial_buffering(std::string_view mode) {
+    if (mode == "line") {
+        return SerialBuffering::Line;
+    } else if (mode == "block") {
+        return SerialBuffering::Block;
+    } else if (mode == "none") {
+        return SerialBuffering::None;
+    }
+
+    throw std::invalid_argument("Invalid serial buffering mode " + std::string { mode });
+}
+
+void Serial::set_mode(SerialBuffering mode) {
+    _mode = mode;
+}
+
+void Serial::set_output(int fd) {
+    _fd = fd;
+}
+
+bool Serial::handle_write(uintptr_t addr, uint8_t size, uint64_t val) {
+    if (addr != serial_addr) {
+        /* Not handled */
+        return false;
+    }
+
+    if (size != 1) crash_and_burn("unexpected write size for serial");
+
+    char ch = val & 0xff;
+
+    if (_mode == SerialBuffering::None || !_running) {
+        /* Nobody to hand this off to, write it ourselves */
+        if (write(_fd, &ch, 1) != 1) {
+            crash_and_burn("failed to write serial output");
+        }
+
+        _bytes.fetch_add(1, std::memory_order_relaxed);
+        _syscalls.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+
+    /* Buffer is full, kick the writer and wait until it made some room */
+    while (head - _tail.load(std::memory_order_acquire) == buffer_size) {
+        _tail_waiters = 1;
+        _wake_writer();
+
+        uint32_t tail = _tail.load();
+        if (head - tail == buffer_size) {
+            futex_wait(_tail, tail, &writer_timeout);
+        }
+    }
+
+    _buffer[head & (buffer_size - 1)] = ch;
+    _head.store(head + 1, std::memory_order_release);
+
+    uint32_t used = head + 1 - _tail.load(std::memory_order_relaxed);
+    if ((_mode == SerialBuffering::Line && ch == '\n') || used >= (buffer_size / 2)) {
+        _wake_writer();
+    }
+
+    return true;
+}
+
+void Serial::drain() {
+    if (!_running) {
+        /* Writer is gone (or never started), so we're the only consumer */
+        _write_pending();
+        return;
+    }
+
+    int attempts = 0;
+    for (uint32_t tail = _tail.load(); _head.load() != tail && attempts < max_drain_attempts; tail = _tail.load()) {
+        ++attempts;
+
+        _tail_waiters = 1;
+        _wake_writer();
+        futex_wait(_tail, tail, &writer_timeout);
+    }
+}
+
+void Serial::entry(std::stop_token stop) {
+    std::stop_callback wake_on_stop { stop, [this] { futex_wake(_head); } };
+
+    _running = true;
+
+    while (!stop.stop_requested()) {
+        _write_pending();
+
+        /* Announce we're going to sleep, then re-check so we can't miss a wakeup */
+        _writer_sleeping = 1;
+
+        uint32_t head = _head.load();
+        if (head == _tail.load(std::memory_order_relaxed) && !stop.stop_requested()) {
+            futex_wait(_head, head, &writer_timeout);
+        }
+
+        _writer_sleeping = 0;
+    }
+
+    _running = false;
+
+    /* Handler can't produce anything anymore, write out the remainder */
+    _write_pending();
+}
+
+uint64_t Serial::bytes() const {
+    return _bytes;
+}
+
+uint64_t Serial::syscalls() const {
+    return _syscalls;
+}
+
+void Serial::_wake_writer() {
+    if (_writer_sleeping.exchange(0)) {
+        futex_wake(_head);
+    }
+}
+
+void Serial::_write_pending() {
+    uint32_t head = _head.load(std::memory_order_acquire);
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+
+    while (head != tail) {
+        uint32_t start = tail & (buffer_size - 1);
+        uint32_t count = head - tail;
+
+        /* Data may wrap around the end of the buffer, write both parts at once */
+        iovec iov[2] {
+            { .iov_base = &_buffer[start], .iov_len = std::min(count, buffer_size - start) },
+            { .iov_base = &_buffer[0],     .iov_len = count - std::min(count, buffer_size - start) },
+        };
+
+        ssize_t res = writev(_fd, iov, iov[1].iov_len ? 2 : 1);
+        if (res <= 0) {
+            crash_and_burn("failed to write serial output");
+        }
+
+        _syscalls.fetch_add(1, std::memory_order_relaxed);
+        _bytes.fetch_add(res, std::memory_order_relaxed);
+
+        tail += res;
+        _tail.store(tail, std::memory_order_release);
+    }
+
+    if (_tail_waiters.exchange(0)) {
+        futex_wake(_tail, INT32_MAX);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <array>
+#include <atomic>
+#include <stop_token>
+#include <string_view>
+
+#include <cstdint>
+
+#include <unistd.h>
+
+static constexpr uintptr_t serial_addr = 0x200;
+
+enum class SerialBuffering {
+    Line,
+    Block,
+    None
+};
+
+SerialBuffering parse_serial_buffering(std::string_view mode);
+
+/* Serial output that is buffered in the signal handler and written out by a separate thread */
+class Serial {
+    /* Power of two, so the free-running indices below wrap correctly */
+    static constexpr uint32_t buffer_size = 64 * 1024;
+
+    std::array<char, buffer_size> _buffer{};
+
+    /* _head is only written by the signal handler, _tail only by the writer thread */
+    std::atomic_uint32_t _head{};
+    std::atomic_uint32_t _tail{};
+
+    /* Set while someone is (about to be) blocked in futex_wait on _head or _tail respectively */
+    std::atomic_uint32_t _writer_sleeping{};
+    std::atomic_uint32_t _tail_waiters{};
+
+    std::atomic_bool _running{};
+
+    SerialBuffering _mode = SerialBuffering::Line;
+    int _fd = STDOUT_FILENO;
+
+    std::atomic_uint64_t _bytes{};
+    std::atomic_uint64_t _syscalls{};
+
+    public:
+    void set_mode(SerialBuffering mode);
+
+    /* Defaults to stdout, set before starting the writer thread */
+    void set_output(int fd);
+
+    /* Return true if handled, signal-safe */
+    bool handle_write(uintptr_t addr, uint8_t size, uint64_t val);
+
+    /* Wait until everything written so far has reached stdout, signal-safe */
+    void drain();
+
+    /* Entrypoint for writer thread */
+    void entry(std::stop_token stop);
+
+    uint64_t bytes() const;
+    uint64_t syscalls() const;
+
+    private:
+    void _wake_writer();
+    void _write_pending();
+};
+
+#endif /* SERIAL_H */
@@ -0,0 +1,132 @@
+#include "time_page.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/* Re-anchor often enough that the coarse clock is useful and drift stays invisible */
+static constexpr timespec time_update_interval { .tv_sec = 0, .tv_nsec = 10'000'000 };
+
+static constexpr uint32_t time_shift = 32;
+
+static uint64_t clock_ns(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+void TimePage::map(std::vector<safe_map>& res) {
+    int fd = memfd_create("rv64-ume-time", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, time_page_size) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        throw std::runtime_error(std::string("Creating time page memfd failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    void* host_map = mmap(nullptr, time_page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (host_map == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(std::string("Mapping time page failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    /* The writable view keeps the memfd open */
+    res.emplace_back(host_map, time_page_size, PROT_READ | PROT_WRITE, fd);
+
+    _page = static_cast<time_page*>(host_map);
+    _page->magic = time_page_magic;
+    _page->version = time_page_version;
+    _update();
+
+    void* guest_map = mmap(reinterpret_cast<void*>(time_page_addr), time_page_size,
+                           PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+
+    if (guest_map != reinterpret_cast<void*>(time_page_addr)) {
+        if (guest_map != MAP_FAILED) {
+            munmap(guest_map, time_page_size);
+        }
+
+        throw std::runtime_error(std::string("Mapping time page failed: ")
+                + strerrorname_np(errno) + " - " + strerror(errno));
+    }
+
+    res.emplace_back(guest_map, time_page_size, PROT_READ);
+}
+
+void TimePage::entry(std::stop_token stop) {
+    std::atomic_uint32_t stopped = 0;
+    std::stop_callback wake_on_stop { stop, [&stopped] {
+        stopped = 1;
+        futex_wake(stopped);
+    } };
+
+    while (!stop.stop_requested()) {
+        futex_wait(stopped, 0, &time_update_interval);
+        _update();
+    }
+}
+
+void TimePage::_update() {
+    uint64_t freq = timer_frequency();
+
+    /* Take the timer on both sides of the clock read, the midpoint is closest */
+    uint64_t before = read_timer();
+    uint64_t ns = clock_ns(CLOCK_MONOTONIC);
+    uint64_t after = read_timer();
+    uint64_t ticks = before + (after - before) / 2;
+
+    /* Against CLOCK_MONOTONIC, so realtime read from the page slews along with the monotonic time */
+    int64_t realtime_offset = clock_ns(CLOCK_REALTIME) - ns;
+
+    uint64_t mult = freq ? (uint64_t { 1'000'000'000 } << time_shift) / freq : 0;
+
+    /**
+     * Never step back, so start from where the guest's line has got to if it ran ahead,
+     * then slow it down to meet CLOCK_MONOTONIC again by the next update. The frequency
+     * being slightly off would otherwise pile up a step at every update, and always
+     * forward. Running at least at half speed keeps it moving if it is far ahead
+     */
+    if (freq && (_page->flags.load(std::memory_order_relaxed) & TimeCounterValid)) {
+        uint64_t elapsed = ticks - _page->ticks_base.load(std::memory_order_relaxed);
+        uint64_t predicted = _page->ns_base.load(std::memory_order_relaxed)
+            + time_page_scale(elapsed, _page->mult.load(std::memory_order_relaxed), time_shift);
+
+        if (predicted > ns) {
+            uint64_t interval_ns = time_update_interval.tv_nsec;
+            uint64_t interval_ticks = freq * interval_ns / 1'000'000'000;
+            uint64_t remaining = interval_ns - std::min(predicted - ns, interval_ns / 2);
+
+            if (interval_ticks) {
+                mult = (remaining << time_shift) / interval_ticks;
+            }
+
+            ns = predicted;
+        }
+    }
+
+    _page->seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    _page->flags.store(freq ? uint32_t { TimeCounterValid } : 0, std::memory_order_relaxed);
+    _page->ticks_base.store(ticks, std::memory_order_relaxed);
+    _page->ns_base.store(ns, std::memory_order_relaxed);
+    _page->mult.store(mult, std::memory_order_relaxed);
+    _page->shift.store(time_shift, std::memory_order_relaxed);
+    _page->frequency.store(freq, std::memory_order_relaxed);
+    _page->coarse_ns.store(ns, std::memory_order_relaxed);
+    _page->realtime_offset_ns.store(realtime_offset, std::memory_order_relaxed);
+
+    _page->seq.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,111 @@
+#ifndef TIME_PAGE_H
+#define TIME_PAGE_H
+
+#include <atomic>
+#include <stop_token>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "elf_file.h"
+
+/**
+ * Read-only page in the guest that tells it the time without trapping, like the vDSO.
+ * The guest reads the time CSR itself and scales it with the published calibration:
+ *   ns = ns_base + ((ticks - ticks_base) * mult) >> shift     (as a 128-bit product)
+ * If the timer frequency is unknown TimeCounterValid is clear, and only coarse_ns is
+ * usable. Everything is re-published every time_update_interval under seq, see
+ * time_page_ns for how to read it consistently.
+ */
+static constexpr uintptr_t time_page_addr = 0xf00000;
+static constexpr size_t time_page_size = 4096;
+static constexpr uint32_t time_page_magic = 0x4d495452; /* "RTIM" */
+static constexpr uint32_t time_page_version = 1;
+
+enum TimeFlags : uint32_t {
+    TimeCounterValid = 1 << 0,
+};
+
+struct time_page {
+    uint32_t magic;
+    uint32_t version;
+
+    /* Odd while being updated, readers retry on a change */
+    std::atomic_uint32_t seq;
+    std::atomic_uint32_t flags;
+
+    /* CLOCK_MONOTONIC in ns at ticks_base */
+    std::atomic_uint64_t ticks_base;
+    std::atomic_uint64_t ns_base;
+    std::atomic_uint64_t mult;
+    std::atomic_uint32_t shift;
+    uint32_t reserved;
+
+    /* Of the time CSR in Hz, 0 if unknown */
+    std::atomic_uint64_t frequency;
+
+    /* CLOCK_MONOTONIC as of the last update */
+    std::atomic_uint64_t coarse_ns;
+
+    /* Add to a monotonic time to get CLOCK_REALTIME */
+    std::atomic_int64_t realtime_offset_ns;
+};
+
+static_assert(sizeof(time_page) <= time_page_size);
+static_assert(std::atomic_uint64_t::is_always_lock_free, "Read with plain loads by the guest");
+
+/* Ticks since ticks_base to ns, the product needs more than 64 bits */
+static inline uint64_t time_page_scale(uint64_t ticks, uint64_t mult, uint32_t shift) {
+    __extension__ using u128 = unsigned __int128;
+    return static_cast<uint64_t>((static_cast<u128>(ticks) * mult) >> shift);
+}
+
+/* Monotonic ns as a guest would read it, without trapping */
+static inline uint64_t time_page_ns(const time_page& page) {
+    for (;;) {
+        uint32_t seq = page.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        uint32_t flags = page.flags.load(std::memory_order_relaxed);
+        uint64_t ticks_base = page.ticks_base.load(std::memory_order_relaxed);
+        uint64_t ns_base = page.ns_base.load(std::memory_order_relaxed);
+        uint64_t mult = page.mult.load(std::memory_order_relaxed);
+        uint32_t shift = page.shift.load(std::memory_order_relaxed);
+        uint64_t coarse_ns = page.coarse_ns.load(std::memory_order_relaxed);
+
+        uint64_t ticks;
+        asm volatile ("rdtime %0" : "=r" (ticks));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (page.seq.load(std::memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        if (!(flags & TimeCounterValid)) {
+            return coarse_ns;
+        }
+
+        return ns_base + time_page_scale(ticks - ticks_base, mult, shift);
+    }
+}
+
+/* Keeps the guest's time page up to date from a thread of its own */
+class TimePage {
+    /* Writable view of the page the guest sees read-only */
+    time_page* _page = nullptr;
+
+    public:
+    /* Map the page into the guest and a writable view of it for the updater, both end up in res */
+    void map(std::vector<safe_map>& res);
+
+    /* Entrypoint for the updater thread, needs map() first */
+    void entry(std::stop_token stop);
+
+    private:
+    void _update();
+};
+
+#endif /* TIME_PAGE_H */
@@ -0,0 +1,40 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <cstdint>
+
+/**
+ * Layout of a basic block trace file: a trace_header, then trace_records in the order
+ * the blocks were entered. Written by the tracer, read by tracedump. Doesn't depend on
+ * anything else in the emulator.
+ */
+static constexpr char trace_magic[8] = { 'R', 'V', 'T', 'R', 'A', 'C', 'E', 0 };
+static constexpr uint32_t trace_version = 1;
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+
+    /* Of the timestamps in the records, 0 if unknown */
+    uint64_t timer_frequency;
+
+    /* Filled in when the trace is closed, records lost to a full buffer aren't in the file */
+    uint64_t records;
+    uint64_t dropped;
+
+    uint64_t reserved[3];
+};
+
+struct trace_record {
+    /* Guest address of the first instruction of the block */
+    uint64_t pc;
+
+    /* read_timer() when the block was entered */
+    uint64_t ticks;
+};
+
+static_assert(sizeof(trace_header) == 64);
+static_assert(sizeof(trace_record) == 16);
+
+#endif /* TRACE_FORMAT_H */
@@ -0,0 +1,128 @@
+/* Prints a basic block trace written by -d, build with `make tracedump` */
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "elf_file.h"
+#include "trace_format.h"
+
+static void help() {
+    std::cerr << "Usage: tracedump [-c] trace-file [executable]" << std::endl
+              << "Prints every block entry with its time since the first one, or with -c how often" << std::endl
+              << "each block was entered. Addresses are symbolized when the executable is given." << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    bool counts = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ch")) != -1) {
+        switch (opt) {
+            case 'c':
+                counts = true;
+                break;
+
+            default:
+                help();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc) {
+        help();
+        return 1;
+    }
+
+    std::unique_ptr<FILE, decltype(&fclose)> file { fopen(argv[optind], "rb"), &fclose };
+    if (!file) {
+        std::cerr << "Could not open " << argv[optind] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file.get()) != 1
+            || memcmp(header.magic, trace_magic, sizeof(trace_magic)) != 0) {
+        std::cerr << argv[optind] << " is not a trace file" << std::endl;
+        return 1;
+    }
+
+    if (header.version != trace_version || header.record_size != sizeof(trace_record)) {
+        std::cerr << "Unsupported trace version " << header.version << std::endl;
+        return 1;
+    }
+
+    std::optional<elf_file> elf;
+    if (optind + 1 < argc) {
+        try {
+            elf.emplace(argv[optind + 1], false);
+        } catch (const std::exception& e) {
+            std::cerr << "Could not read " << argv[optind + 1] << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    auto name = [&elf](uint64_t pc) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "0x%016lx", pc);
+
+        return elf ? std::string(buf) + " " + elf->symbolize(pc) : std::string(buf);
+    };
+
+    std::map<uint64_t, uint64_t> per_block;
+    std::optional<uint64_t> first;
+    uint64_t records = 0;
+
+    trace_record record;
+    while (fread(&record, sizeof(record), 1, file.get()) == 1) {
+        ++records;
+
+        if (counts) {
+            per_block[record.pc] += 1;
+            continue;
+        }
+
+        if (!first) {
+            first = record.ticks;
+        }
+
+        /* Ticks are all we have without the frequency */
+        uint64_t delta = record.ticks - *first;
+        if (header.timer_frequency) {
+            printf("%14.3f us  %s\n", delta * 1e6 / header.timer_frequency, name(record.pc).c_str());
+        } else {
+            printf("%14lu     %s\n", delta, name(record.pc).c_str());
+        }
+    }
+
+    if (counts) {
+        std::vector<std::pair<uint64_t, uint64_t>> sorted(per_block.begin(), per_block.end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const auto& a, const auto& b) { return a.second > b.second; });
+
+        for (const auto& [pc, count] : sorted) {
+            printf("%12lu  %s\n", count, name(pc).c_str());
+        }
+    }
+
+    /* A trace from a run that crashed never had its header finished */
+    std::cerr << records << " records, " << header.dropped << " dropped";
+    if (header.records != records) {
+        std::cerr << ", header says " << header.records << " records (unfinished trace?)";
+    }
+    std::cerr << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,353 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "basic_blocks.h"
+#include "util.h"
+
+/* How long the writer sleeps before writing out whatever is pending anyway */
+static constexpr timespec writer_timeout { .tv_sec = 0, .tv_nsec = 50'000'000 };
+
+static int64_t sext(uint64_t val, int bits) {
+    return static_cast<int64_t>(val << (64 - bits)) >> (64 - bits);
+}
+
+static trace_header make_header() {
+    trace_header header { };
+    std::copy(std::begin(trace_magic), std::end(trace_magic), header.magic);
+    header.version = trace_version;
+    header.record_size = sizeof(trace_record);
+    header.timer_frequency = timer_frequency();
+
+    return header;
+}
+
+Tracer::Tracer(const std::string& path, uint32_t budget) : _budget { budget } {
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        throw std::runtime_error("Could not open trace file " + path + ": " + strerror(errno));
+    }
+
+    trace_header header = make_header();
+    if (write(_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(_fd);
+        throw std::runtime_error("Could not write trace file " + path + ": " + strerror(errno));
+    }
+
+    /* Touch it all now so the handler never faults memory in */
+    _ring.assign(ring_size, trace_record { });
+}
+
+Tracer::~Tracer() {
+    remove();
+
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+void Tracer::instrument(const elf_file& elf) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    for (const safe_map& program : elf.programs()) {
+        if (!(program.prot() & PROT_EXEC)) {
+            continue;
+        }
+
+        uintptr_t begin = reinterpret_cast<uintptr_t>(program.map());
+        uintptr_t end = begin + program.size();
+
+        std::vector<block> blocks;
+        for (const basic_block& found : find_basic_blocks(elf, program)) {
+            blocks.push_back(block { found.pc, 0, found.original, found.length, false, program.prot(), 0 });
+        }
+
+        if (blocks.empty()) {
+            continue;
+        }
+
+        /* Out of line copies for everything that doesn't depend on its address */
+        size_t relocated = std::count_if(blocks.begin(), blocks.end(), [](const block& b) {
+            return decode_flow(b.original).kind == Flow::None;
+        });
+
+        size_t region_size = (relocated * trampoline_size + page_size - 1) & ~(page_size - 1);
+        void* region = relocated ? map_near(begin, end, region_size, jal_range) : MAP_FAILED;
+        char* slot = region != MAP_FAILED ? static_cast<char*>(region) : nullptr;
+
+        for (block& b : blocks) {
+            if (decode_flow(b.original).kind != Flow::None) {
+                continue;
+            }
+
+            uintptr_t tramp = reinterpret_cast<uintptr_t>(slot);
+            intptr_t back = (b.pc + b.length) - (tramp + b.length);
+
+            if (!slot || back < -static_cast<intptr_t>(jal_range) || back >= static_cast<intptr_t>(jal_range)) {
+                /* Too far away to jump back, leave this block out */
+                b.retired = true;
+                continue;
+            }
+
+            memcpy(slot, &b.original, b.length);
+
+            uint32_t jump = (((back >> 20) & 1) << 31) | (((back >> 1) & 0x3ff) << 21)
+                          | (((back >> 11) & 1) << 20) | (((back >> 12) & 0xff) << 12) | 0x6f;
+            memcpy(slot + b.length, &jump, sizeof(jump));
+
+            b.trampoline = tramp;
+            slot += trampoline_size;
+        }
+
+        if (slot) {
+            mprotect(region, region_size, PROT_READ | PROT_EXEC);
+            __builtin___clear_cache(static_cast<char*>(region), slot);
+            _trampolines.emplace_back(region, region_size, PROT_READ | PROT_EXEC);
+        }
+
+        std::vector<basic_block> traced;
+        for (const block& b : blocks) {
+            if (b.retired) {
+                ++_skipped;
+            } else {
+                traced.push_back(basic_block { b.pc, b.original, b.length });
+            }
+        }
+
+        plant_breakpoints(program, traced);
+
+        std::erase_if(blocks, [](const block& b) { return b.retired; });
+        _blocks.insert(_blocks.end(), blocks.begin(), blocks.end());
+    }
+
+    std::sort(_blocks.begin(), _blocks.end(), [](const block& a, const block& b) { return a.pc < b.pc; });
+}
+
+void Tracer::remove() {
+    for (block& b : _blocks) {
+        if (!b.retired) {
+            write_instruction(b.pc, b.original, b.length, b.prot);
+            b.retired = true;
+        }
+    }
+
+    _blocks.clear();
+    _trampolines.clear();
+}
+
+bool Tracer::hit(ucontext_t* ctx) {
+    uint64_t begin = read_timer();
+    uintptr_t pc = ctx->uc_mcontext.__gregs[REG_PC];
+
+    block* b = _find(pc);
+    if (!b || b->retired) {
+        return false;
+    }
+
+    _entries += 1;
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == ring_size) {
+        /* The writer can't keep up, never block the guest on it. Counted as entries - written */
+    } else {
+        _ring[head & (ring_size - 1)] = trace_record { pc, begin };
+        _head.store(head + 1, std::memory_order_release);
+
+        if (head + 1 - _tail.load(std::memory_order_relaxed) >= ring_size / 2) {
+            _wake_writer();
+        }
+    }
+
+    if (_budget && ++b->hits == _budget) {
+        /* Run the original from now on, starting with this entry */
+        write_instruction(b->pc, b->original, b->length, b->prot);
+        b->retired = true;
+        _retired += 1;
+    } else if (b->trampoline) {
+        ctx->uc_mcontext.__gregs[REG_PC] = b->trampoline;
+    } else {
+        _emulate(ctx, *b);
+    }
+
+    _ticks += read_timer() - begin;
+    return true;
+}
+
+void Tracer::entry(std::stop_token stop) {
+    std::stop_callback wake_on_stop { stop, [this] { futex_wake(_head); } };
+
+    while (!stop.stop_requested()) {
+        _write_pending();
+
+        /* Announce we're going to sleep, then re-check so we can't miss a wakeup */
+        _writer_sleeping = 1;
+
+        uint32_t head = _head.load();
+        if (head == _tail.load(std::memory_order_relaxed) && !stop.stop_requested()) {
+            futex_wait(_head, head, &writer_timeout);
+        }
+
+        _writer_sleeping = 0;
+    }
+
+    _write_pending();
+
+    /* Now that the counts are known */
+    trace_header header = make_header();
+    header.records = _written;
+    header.dropped = _entries - _written;
+
+    if (pwrite(_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        std::cerr << "Trace: could not finish the header: " << strerror(errno) << std::endl;
+    }
+}
+
+void Tracer::print_summary(std::ostream& out, double trap_ns) const {
+    uint64_t freq = timer_frequency();
+
+    out << std::dec << "Trace: " << _entries << " block entries, " << (_entries - _written)
+        << " dropped, " << _retired << " blocks reached the budget, " << _skipped << " could not be traced";
+
+    if (freq && _entries) {
+        double handler_ns = _ticks * 1e9 / freq / _entries;
+        out << ", " << (handler_ns + trap_ns) << " ns per entry (" << handler_ns << " ns in the handler)";
+    }
+
+    out << std::endl;
+}
+
+Tracer::block* Tracer::_find(uintptr_t pc) {
+    auto it = std::lower_bound(_blocks.begin(), _blocks.end(), pc,
+                               [](const block& b, uintptr_t pc) { return b.pc < pc; });
+
+    return (it != _blocks.end() && it->pc == pc) ? &*it : nullptr;
+}
+
+void Tracer::_emulate(ucontext_t* ctx, const block& b) {
+    auto* regs = ctx->uc_mcontext.__gregs;
+    auto get = [regs](uint32_t r) -> uint64_t { return r ? regs[r] : 0; };
+    auto set = [regs](uint32_t r, uint64_t val) { if (r) regs[r] = val; };
+
+    uint32_t i = b.original;
+    flow_info flow = decode_flow(i);
+    uintptr_t next = b.pc + b.length;
+
+    if (b.length == 2) {
+        uint32_t funct3 = (i >> 13) & 0b111;
+
+        if ((i & 0b11) == 0b01 && funct3 == 0b101) {
+            next = b.pc + flow.offset;
+        } else if ((i & 0b11) == 0b01) {
+            uint64_t val = regs[8 + ((i >> 7) & 0b111)];
+            if ((funct3 == 0b110) == (val == 0)) {
+                next = b.pc + flow.offset;
+            }
+        } else {
+            /* c.jr, or c.jalr which also links */
+            uint64_t target = get((i >> 7) & 0x1f);
+            if (i & (1 << 12)) {
+                set(1, next);
+            }
+
+            next = target;
+        }
+    } else {
+        uint32_t rd = (i >> 7) & 0x1f;
+        uint32_t rs1 = (i >> 15) & 0x1f;
+        uint32_t rs2 = (i >> 20) & 0x1f;
+
+        switch (i & 0x7f) {
+            case 0x6f:
+                set(rd, next);
+                next = b.pc + flow.offset;
+                break;
+
+            case 0x67: {
+                /* Read rs1 before linking, they may be the same register */
+                uint64_t target = (get(rs1) + sext(i >> 20, 12)) & ~uint64_t { 1 };
+                set(rd, next);
+                next = target;
+                break;
+            }
+
+            case 0x63: {
+                uint64_t lhs = get(rs1);
+                uint64_t rhs = get(rs2);
+                bool taken = false;
+
+                switch ((i >> 12) & 0b111) {
+                    case 0b000: taken = lhs == rhs; break;
+                    case 0b001: taken = lhs != rhs; break;
+                    case 0b100: taken = static_cast<int64_t>(lhs) < static_cast<int64_t>(rhs); break;
+                    case 0b101: taken = static_cast<int64_t>(lhs) >= static_cast<int64_t>(rhs); break;
+                    case 0b110: taken = lhs < rhs; break;
+                    case 0b111: taken = lhs >= rhs; break;
+                }
+
+                if (taken) {
+                    next = b.pc + flow.offset;
+                }
+                break;
+            }
+
+            case 0x17:
+                set(rd, b.pc + sext(i & 0xfffff000, 32));
+                break;
+        }
+    }
+
+    regs[REG_PC] = next;
+}
+
+void Tracer::_write_pending() {
+    uint32_t head = _head.load(std::memory_order_acquire);
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+
+    while (head != tail) {
+        uint32_t start = tail & (ring_size - 1);
+        uint32_t count = std::min(head - tail, ring_size - start);
+
+        if (!_write_failed) {
+            const char* data = reinterpret_cast<const char*>(&_ring[start]);
+            size_t bytes = count * sizeof(trace_record);
+
+            while (bytes > 0) {
+                ssize_t res = write(_fd, data, bytes);
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (res <= 0) {
+                    std::cerr << "Trace: writing failed, dropping the rest: " << strerror(errno) << std::endl;
+                    _write_failed = true;
+                    break;
+                }
+
+                data += res;
+                bytes -= res;
+            }
+
+            if (!_write_failed) {
+                _written += count;
+            }
+        }
+
+        tail += count;
+        _tail.store(tail, std::memory_order_release);
+    }
+}
+
+void Tracer::_wake_writer() {
+    if (_writer_sleeping.exchange(0)) {
+        futex_wake(_head);
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <ostream>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/ucontext.h>
+
+#include "elf_file.h"
+#include "trace_format.h"
+
+static constexpr uint32_t default_trace_budget = 10000;
+
+/**
+ * Records every basic block the guest enters. The first instruction of each block is
+ * replaced by an ebreak, the SIGTRAP handler logs the block and then either emulates
+ * the displaced instruction (jumps, branches and auipc, which depend on their address)
+ * or runs a copy of it in a trampoline that jumps back. Records go into a fixed ring
+ * that a writer thread streams to a file, see trace_format.h. A block that was entered
+ * budget times gets its original instruction back, which bounds the cost of hot loops.
+ */
+class Tracer {
+    /* Power of two, so the free-running indices below wrap correctly */
+    static constexpr uint32_t ring_size = 1 << 20;
+
+    /* Trampolines need to be within jal range (+-1 MiB) of the code they return to */
+    static constexpr uintptr_t jal_range = 1 << 20;
+    static constexpr size_t trampoline_size = 8;
+
+    struct block {
+        uintptr_t pc;
+
+        /* Copy of the instruction followed by a jump back, 0 if it's emulated instead */
+        uintptr_t trampoline;
+
+        uint32_t original;
+        uint8_t length;
+        bool retired;
+        int prot;
+        uint32_t hits;
+    };
+
+    /* Sorted by pc, never resized after instrument() so the handler can search it */
+    std::vector<block> _blocks;
+    std::vector<safe_map> _trampolines;
+
+    std::vector<trace_record> _ring;
+
+    /* _head is only written by the signal handler, _tail only by the writer thread */
+    std::atomic_uint32_t _head{};
+    std::atomic_uint32_t _tail{};
+    std::atomic_uint32_t _writer_sleeping{};
+
+    int _fd = -1;
+    uint32_t _budget;
+    bool _write_failed = false;
+
+    uint64_t _entries = 0;
+    uint64_t _written = 0;
+    uint64_t _retired = 0;
+    uint64_t _skipped = 0;
+
+    /* Time spent in hit(), in timer ticks */
+    uint64_t _ticks = 0;
+
+    public:
+    /* Budget 0 traces every entry of every block */
+    Tracer(const std::string& path, uint32_t budget);
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    /* Find the blocks in elf's code sections and plant the breakpoints */
+    void instrument(const elf_file& elf);
+
+    /* Put every original instruction back, the executable stays loaded between daemon runs */
+    void remove();
+
+    /* Called from the SIGTRAP handler, false if the breakpoint isn't one of ours. Signal-safe */
+    bool hit(ucontext_t* ctx);
+
+    /* Entrypoint for the writer thread, finishes the file once stopped */
+    void entry(std::stop_token stop);
+
+    /* trap_ns is what the kernel adds to every entry on top of the handler */
+    void print_summary(std::ostream& out, double trap_ns) const;
+
+    private:
+    block* _find(uintptr_t pc);
+    void _emulate(ucontext_t* ctx, const block& b);
+    void _write_pending();
+    void _wake_writer();
+};
+
+#endif /* TRACER_H */
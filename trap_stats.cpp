@@ -0,0 +1,109 @@
+#include "trap_stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdio>
+
+#include "util.h"
+
+static constexpr const char* device_names[NUM_TRAP_DEVICES] {
+    "start", "exit", "serial", "fb control", "fb palette", "bulk io", "disk", "other"
+};
+
+void TrapStats::reset() {
+    _devices = { };
+    _sites = { };
+    _untracked = 0;
+    _histogram = { };
+}
+
+void TrapStats::record(uintptr_t pc, TrapDevices device, uint64_t ticks) {
+    _devices[device].traps += 1;
+    _devices[device].ticks += ticks;
+
+    _histogram[ticks ? std::bit_width(ticks) - 1 : 0] += 1;
+
+    /* Open addressing, instructions are at least 2-byte aligned */
+    size_t idx = (pc >> 1) & (max_sites - 1);
+    for (size_t probe = 0; probe < max_sites; ++probe, idx = (idx + 1) & (max_sites - 1)) {
+        site& s = _sites[idx];
+
+        if (s.traps == 0) {
+            s.pc = pc;
+            s.device = device;
+        }
+
+        if (s.pc == pc) {
+            s.traps += 1;
+            s.ticks += ticks;
+            return;
+        }
+    }
+
+    _untracked += 1;
+}
+
+void TrapStats::print(std::ostream& out, const elf_file& elf, size_t top) const {
+    uint64_t freq = timer_frequency();
+
+    /* Timer ticks as nanoseconds if the frequency is known */
+    auto ns = [freq](double ticks) { return freq ? ticks * 1e9 / freq : ticks; };
+    const char* unit = freq ? "ns" : "ticks";
+
+    char buf[256];
+
+    out << "Traps per device:" << std::endl;
+    for (size_t i = 0; i < NUM_TRAP_DEVICES; ++i) {
+        const device_totals& dev = _devices[i];
+        if (dev.traps == 0) {
+            continue;
+        }
+
+        snprintf(buf, sizeof(buf), "  %-12s %12" PRIu64 " traps, %10.1f %s avg, %14.0f %s total",
+                 device_names[i], dev.traps, ns(static_cast<double>(dev.ticks) / dev.traps), unit,
+                 ns(dev.ticks), unit);
+        out << buf << std::endl;
+    }
+
+    out << "Handler latency:" << std::endl;
+
+    uint64_t most = *std::max_element(_histogram.begin(), _histogram.end());
+    for (size_t i = 0; i < num_buckets; ++i) {
+        if (_histogram[i] == 0) {
+            continue;
+        }
+
+        double low = i ? ns(static_cast<double>(uint64_t { 1 } << i)) : 0;
+        double high = ns(static_cast<double>(uint64_t { 1 } << i) * 2);
+        int bar = static_cast<int>(40.0 * _histogram[i] / most);
+
+        snprintf(buf, sizeof(buf), "  [%10.0f, %10.0f) %s %12" PRIu64 " %.*s",
+                 low, high, unit, _histogram[i], std::max(bar, 1),
+                 "########################################");
+        out << buf << std::endl;
+    }
+
+    std::vector<const site*> sites;
+    for (const site& s : _sites) {
+        if (s.traps > 0) {
+            sites.push_back(&s);
+        }
+    }
+
+    std::sort(sites.begin(), sites.end(), [](const site* a, const site* b) { return a->traps > b->traps; });
+    sites.resize(std::min(sites.size(), top));
+
+    out << "Hottest trap sites:" << std::endl;
+    for (const site* s : sites) {
+        snprintf(buf, sizeof(buf), "  %12" PRIu64 " traps, %10.1f %s avg  %-10s  0x%.8" PRIxPTR "  ",
+                 s->traps, ns(static_cast<double>(s->ticks) / s->traps), unit, device_names[s->device], s->pc);
+        out << buf << elf.symbolize(s->pc) << std::endl;
+    }
+
+    if (_untracked > 0) {
+        out << "  (" << _untracked << " traps at sites that didn't fit in the table)" << std::endl;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef TRAP_STATS_H
+#define TRAP_STATS_H
+
+#include <array>
+#include <ostream>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "elf_file.h"
+
+/* What a trap was for, finer grained than Device so palette uploads stand out */
+enum TrapDevices : uint8_t {
+    TrapStart = 0,
+    TrapExit,
+    TrapSerial,
+    TrapFbControl,
+    TrapFbPalette,
+    TrapBulkIO,
+    TrapDisk,
+    TrapOther,
+    NUM_TRAP_DEVICES
+};
+
+/**
+ * Trap counts per device and per faulting PC, with a log2 histogram of the time
+ * spent in the handler. Fixed size and lock-free so the signal handler can use it.
+ */
+class TrapStats {
+    /* Power of two, PCs that don't fit anymore only show up in the totals */
+    static constexpr size_t max_sites = 1024;
+    static constexpr size_t num_buckets = 64;
+
+    struct site {
+        uintptr_t pc;
+        uint64_t traps;
+        uint64_t ticks;
+        TrapDevices device;
+    };
+
+    struct device_totals {
+        uint64_t traps;
+        uint64_t ticks;
+    };
+
+    std::array<device_totals, NUM_TRAP_DEVICES> _devices{};
+    std::array<site, max_sites> _sites{};
+    uint64_t _untracked = 0;
+
+    /* Bucket i counts handler times in [2^i, 2^(i+1)) ticks, 0 ticks goes into bucket 0 */
+    std::array<uint64_t, num_buckets> _histogram{};
+
+    public:
+    void reset();
+
+    /* Signal-safe */
+    void record(uintptr_t pc, TrapDevices device, uint64_t ticks);
+
+    /* Per-device totals, the histogram and the top hottest PCs, symbolized against elf */
+    void print(std::ostream& out, const elf_file& elf, size_t top) const;
+};
+
+#endif /* TRAP_STATS_H */
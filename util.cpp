@@ -1,10 +1,18 @@
 #include "util.h"
 
+#include <fstream>
 #include <stdexcept>
 
 #include <cstdio>
 #include <cinttypes>
 
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static void (*g_crash_hook)() = nullptr;
+
 std::map<std::string_view, uint8_t> reg_name_map {
     { "ra",   1 }, { "x1",   1 },
     { "sp",   2 }, { "x2",   2 },
@@ -62,17 +70,106 @@ reg_init::reg_init(std::string_view init) {
     }
 }
 
+void load_conf(const std::string& path, std::vector<reg_init>& pre, std::vector<reg_init>& post) {
+    /* Simpler, less generic .conf parsing */
+    bool is_pre = false;
+    bool is_post = false;
+
+    std::ifstream in { path };
+
+    for (std::string line; std::getline(in, line);) {
+        if (line.empty()) {
+            continue;
+        }
+
+        if (!is_pre && !is_post) {
+            if (line == "[pre]") {
+                is_pre = true;
+            } else {
+                throw std::runtime_error("Error: expected [pre] section, got " + line);
+            }
+        } else if (is_pre && !is_post) {
+            if (line == "[post]") {
+                is_pre = false;
+                is_post = true;
+            } else {
+                pre.emplace_back(line);
+            }
+        } else if (!is_pre && is_post) {
+            post.emplace_back(line);
+        }
+    }
+}
+
+std::string test_executable(const std::string& conf) {
+    return conf.substr(0, conf.size() - 4) + "bin";
+}
+
+std::string read_fd(int fd) {
+    std::string res;
+
+    char buf[4096];
+    off_t off = 0;
+    for (ssize_t count; (count = pread(fd, buf, sizeof(buf), off)) > 0; off += count) {
+        res.append(buf, count);
+    }
+
+    return res;
+}
+
+std::string json_escape(std::string_view str) {
+    std::string res;
+
+    for (char ch : str) {
+        switch (ch) {
+            case '"':  res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n";  break;
+            case '\t': res += "\\t";  break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", ch);
+                    res += esc;
+                } else {
+                    res += ch;
+                }
+        }
+    }
+
+    return res;
+}
+
 void crash_and_burn(const char* msg) {
     size_t chars = 0;
     const char* cur = msg;
     while (*cur++) ++chars;
 
+    if (g_crash_hook) {
+        g_crash_hook();
+    }
+
     /* write isn't checked because if it fails we're screwed anyway */
     write(STDOUT_FILENO, msg, chars);
     if (msg[chars-1] != '\n') write(STDOUT_FILENO, "\n", 1);
     _exit(ExitCodes::SigHandlerFailure);
 }
 
+void set_crash_hook(void (*hook)()) {
+    g_crash_hook = hook;
+}
+
+void futex_wait(std::atomic_uint32_t& word, uint32_t expected, const timespec* timeout) {
+    static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t));
+
+    /* EAGAIN, EINTR and ETIMEDOUT are all fine, the caller re-checks anyway */
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic_uint32_t& word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
 void dump_regs(__riscv_mc_gp_state regs) {
     /* Holds at most a hex 64-bit integer, plus null terminator */
     char buf[16 + 1];
@@ -98,4 +195,41 @@ void dump_regs(__riscv_mc_gp_state regs) {
 
         write(STDOUT_FILENO, "\n", 1);
     }
-}
\ No newline at end of file
+}
+
+uint64_t timer_frequency() {
+    static uint64_t freq = [] {
+        /* Single big-endian cell */
+        std::ifstream in { "/proc/device-tree/cpus/timebase-frequency", std::ios::binary };
+
+        unsigned char cell[4];
+        if (!in.read(reinterpret_cast<char*>(cell), sizeof(cell))) {
+            return uint64_t { 0 };
+        }
+
+        return (uint64_t { cell[0] } << 24) | (cell[1] << 16) | (cell[2] << 8) | cell[3];
+    }();
+
+    return freq;
+}
+
+void* map_near(uintptr_t begin, uintptr_t end, size_t size, uintptr_t range) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    void* map = MAP_FAILED;
+    for (uintptr_t addr = (end + page_size - 1) & ~(page_size - 1);
+            map == MAP_FAILED && (addr + size) <= (begin + range); addr += size) {
+        map = mmap(reinterpret_cast<void*>(addr), size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    }
+
+    for (uintptr_t addr = (begin & ~(page_size - 1)) - size;
+            map == MAP_FAILED && begin > size && addr >= size && (addr + range) >= end;
+            addr -= size) {
+        map = mmap(reinterpret_cast<void*>(addr), size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    }
+
+    return map;
+}
@@ -1,10 +1,15 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <atomic>
 #include <map>
+#include <string>
 #include <string_view>
+#include <vector>
 
+#include <cstddef>
 #include <cstdint>
+#include <ctime>
 
 #include <signal.h>
 
@@ -17,7 +22,8 @@ enum ExitCodes : int {
     UnitTestFailed = 5,
     NotSupported = 6,
     SigHandlerFailure = 7,
-    FramebufferError = 8
+    FramebufferError = 8,
+    BenchmarkRegression = 9
 };
 
 /* Can't use reg_name_map because this should be signal-safe(-ish) */
@@ -41,6 +47,46 @@ enum ExitTypes : int {
     ExitByMarker = 2,
 };
 
+/* Hardware and software events counted with perf_event_open, see perf_counters.h */
+enum PerfEvents : uint8_t {
+    PerfCycles = 0,
+    PerfInstructions,
+    PerfCacheMisses,
+    PerfBranchMisses,
+    PerfPageFaults,
+    PerfContextSwitches,
+    NUM_PERF_EVENTS
+};
+
+static constexpr const char* perf_event_names[NUM_PERF_EVENTS] {
+    "cycles", "instructions", "cache-misses", "branch-misses", "page-faults", "context-switches"
+};
+
+/* Counts between guest entry and exit, split by whether they happened in the trap handler */
+struct perf_count {
+    bool valid;
+    uint64_t guest;
+    uint64_t handler;
+};
+
+/* Outcome of a single guest run, plain data so it can be passed out of a forked child */
+struct run_result {
+    int status;
+    ExitTypes exit_type;
+    uint32_t mismatches;
+    uint64_t elapsed_ns;
+    uint64_t mmio_traps;
+
+    /* From the timer between guest start and exit, 0 if its frequency is unknown. pure_ns has
+     * the handler time and the calibrated kernel cost of every trap taken out */
+    uint64_t raw_ns;
+    uint64_t handler_ns;
+    uint64_t pure_ns;
+
+    reg_val regs[NUM_REGS];
+    perf_count perf[NUM_PERF_EVENTS];
+};
+
 struct reg_init {
     reg_num num;
     reg_val val;
@@ -50,8 +96,41 @@ struct reg_init {
     reg_init(std::string_view init);
 };
 
-void crash_and_burn(const char* msg);
+/* Read the [pre] and [post] register sections of a .conf test file */
+void load_conf(const std::string& path, std::vector<reg_init>& pre, std::vector<reg_init>& post);
+
+/* A test's executable lives next to it, with .bin instead of .conf */
+std::string test_executable(const std::string& conf);
+
+/* Everything in fd from offset 0, regardless of the current file position */
+std::string read_fd(int fd);
+
+/* Contents for a JSON string literal, without the quotes */
+std::string json_escape(std::string_view str);
+
+[[noreturn]] void crash_and_burn(const char* msg);
+
+/* Called by crash_and_burn before exiting, must be signal-safe */
+void set_crash_hook(void (*hook)());
+
+/* Raw futex wrappers, safe to use from a signal handler unlike std::atomic::wait */
+void futex_wait(std::atomic_uint32_t& word, uint32_t expected, const timespec* timeout = nullptr);
+void futex_wake(std::atomic_uint32_t& word, int count = 1);
 
 void dump_regs(__riscv_mc_gp_state regs);
 
+/* Map size bytes read-write as close as possible to [begin, end), first above then below, all
+ * of it within range of the other end. MAP_FAILED if there's no room */
+void* map_near(uintptr_t begin, uintptr_t end, size_t size, uintptr_t range);
+
+/* The cycle CSR usually isn't accessible from user mode, but time is */
+static inline uint64_t read_timer() {
+    uint64_t ticks;
+    asm volatile ("rdtime %0" : "=r" (ticks));
+    return ticks;
+}
+
+/* Frequency of read_timer in Hz from the device tree, 0 if unknown */
+uint64_t timer_frequency();
+
 #endif /* UTIL_H */